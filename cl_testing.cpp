@@ -6,8 +6,11 @@
 #include <tuple>
 #include <memory>
 #include <algorithm>
+#include <chrono>
 #include <set>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/lockfree/queue.hpp>
@@ -16,6 +19,16 @@
 #include "bad_queue.hpp"
 #include "boost_queue.hpp"
 #include "mpmc_q.h"
+#include "mpmc_broadcast.h"
+#include "mpmc_byte_ring.h"
+#include "mpmc_conflating.h"
+#include "mpmc_coro.h"
+#include "mpmc_credit.h"
+#include "mpmc_persist.h"
+#include "mpmc_priority.h"
+#include "mpmc_sharded.h"
+#include "mpmc_unbounded.h"
+#include "shm_region.h"
 
 template <int Align>
 int simpleTest(const std::string& pc);
@@ -31,6 +44,8 @@ std::mutex g_cout_lock;
 
 std::atomic<uint64_t> g_send{0};
 std::atomic<uint64_t> g_recv{0};
+std::atomic<uint32_t> g_pdone{0};	// producers that have returned
+std::atomic<uint32_t> g_cdone{0};	// consumers that have returned
 
 }
 struct Benchmark
@@ -156,6 +171,11 @@ struct CycleTracker
     uint32_t polls_{0};
     uint32_t works_{0};
 
+    // Only updated after a parked consumer has been woken, so off the hot
+    // path, and read by the monitor. Not reset by clear().
+    std::atomic<uint64_t> wakeups_{0};
+    std::atomic<uint64_t> wakeCycles_{0};
+
     // There is intentional false sharing on this, however the impact is unmasurable
     // as long as getResults is called infrequently
     // for the purpose of monitoring we will update this once a second
@@ -270,10 +290,16 @@ struct CycleTracker
         ++polls_;
     }
 
-    void addDuty(uint64_t d)
+    void addDuty(uint64_t d, uint32_t works = 1)
     {
         saturation_ += d;
-        ++works_;
+        works_ += works;
+    }
+
+    void addWakeups(const wait_stats& ws)
+    {
+        wakeups_.store(wakeups_.load(std::memory_order_relaxed) + ws.wakeups, std::memory_order_relaxed);
+        wakeCycles_.store(wakeCycles_.load(std::memory_order_relaxed) + ws.wake_cycles, std::memory_order_relaxed);
     }
 
 	bool cleared()
@@ -300,14 +326,14 @@ struct CycleTracker
             if (p2_)
                 ct_.addOverhead(p2_ - p1_);
             if (p3_)
-                ct_.addDuty(p3_ - p2_);
+                ct_.addDuty(p3_ - p2_, works_);
 
             ct_.calcResults(rs_);
         }
 
         void markOne() { p1_ = getcc_ns(); }
         void markTwo() { p2_ = getcc_ns(); }
-        void markThree() { p3_ = getcc_ns(); }
+        void markThree(uint32_t works = 1) { p3_ = getcc_ns(); works_ = works; }
 
         CycleTracker& ct_;
         ResultsSync& rs_;
@@ -315,11 +341,14 @@ struct CycleTracker
         uint64_t p1_{0};
         uint64_t p2_{0};
         uint64_t p3_{0};
+        uint32_t works_{1};
     };
 };
 ///////////////////////////////////////////////////////////////////////////////
 
-template <typename T, typename Q>
+// Blocking uses push_wait/pop_wait and the queue's wait strategy
+// instead of spinning on failed push/pop.
+template <typename T, typename Q, bool Blocking = false>
 void producer(Q* q, uint32_t iterations, uint64_t workCycles, uint32_t workIterations)
 {
 	while (Thread::g_pstart.load() == false) {}
@@ -336,6 +365,12 @@ void producer(Q* q, uint32_t iterations, uint64_t workCycles, uint32_t workItera
 	while(Thread::g_pstart)
 	{
 		d.get().seq = c+1;
+		if constexpr (Blocking)
+		{
+			q->push_wait(d);
+			++c;
+			continue;
+		}
 		do 
 		{ 
 			work = (q->push(d));
@@ -353,14 +388,27 @@ void producer(Q* q, uint32_t iterations, uint64_t workCycles, uint32_t workItera
 		
 	}
 	Thread::g_send+=c;
+	Thread::g_pdone++;
 	std::lock_guard<std::mutex> 
 		lock(Thread::g_cout_lock);
 
 	std::cout << "Sent " << c << " messages " << std::endl;
 }
 
+template <typename Q, typename = void>
+struct has_pop_stashed : std::false_type {};
+
+template <typename Q>
+struct has_pop_stashed<Q, std::void_t<decltype(&Q::pop_stashed)>> : std::true_type {};
+
+template <typename Q, typename = void>
+struct has_cell_size : std::false_type {};
+
+template <typename Q>
+struct has_cell_size<Q, std::void_t<decltype(&Q::cell_size)>> : std::true_type {};
+
 // EX2: Begin
-template <typename T, typename Q, typename WD>
+template <typename T, typename Q, typename WD, bool Blocking = false>
 void consumer(Q* q, int32_t iterations, ResultsSync& rs, CycleTracker& ct, WD& wd)
 {
 	while (Thread::g_cstart.load() == false) {}
@@ -378,7 +426,16 @@ void consumer(Q* q, int32_t iterations, ResultsSync& rs, CycleTracker& ct, WD& w
         cp.markOne(); // roll into CheckPoint constructor?
 
         start = getcc_ns();
-        work = q->pop(d);
+        if constexpr (Blocking)
+        {
+            wait_stats ws;
+            q->pop_wait(d, &ws);
+            if (ws.wakeups)
+                ct.addWakeups(ws);
+            work = true;
+        }
+        else
+            work = q->pop(d);
         if (!work)
         {
             cp.markTwo();
@@ -412,11 +469,124 @@ void consumer(Q* q, int32_t iterations, ResultsSync& rs, CycleTracker& ct, WD& w
 		++c;
     }
 
+    // elements a sharded queue consumer stole and still holds
+    if constexpr (has_pop_stashed<Q>::value)
+    {
+        while (q->pop_stashed(d))
+            ++c;
+    }
+
+	Thread::g_recv+=c;
+	Thread::g_cdone++;
+	std::lock_guard<std::mutex> 
+		lock(Thread::g_cout_lock);
+	std::cout << "Recieved " << c << " messages " << std::endl;
+}
+// Queues other than mpmc_queue (boost, unbounded) have no bulk API
+template <typename Q, typename = void>
+struct has_pop_bulk : std::false_type {};
+
+template <typename Q>
+struct has_pop_bulk<Q, std::void_t<decltype(std::declval<Q&>().pop_bulk(nullptr, 0))>> : std::true_type {};
+
+template <typename Q, typename = void>
+struct has_size_approx : std::false_type {};
+
+template <typename Q>
+struct has_size_approx<Q, std::void_t<decltype(std::declval<Q&>().reset_high_water_mark())>> : std::true_type {};
+
+// Current depth and the peak since the last report, per ring
+template <typename Q>
+void printDepth ( Q& q )
+{
+    if constexpr (has_size_approx<Q>::value)
+    {
+        std::cout << "Queue: depth = " << q.size_approx()
+                  << ", peak depth = " << q.reset_high_water_mark()
+                  << " of " << q.capacity() << std::endl;
+    }
+}
+
+template <typename T, typename Shard>
+void printDepth ( mpmc_sharded_queue<T, Shard>& q )
+{
+    for (uint32_t i = 0; i < q.shards(); ++i)
+    {
+        std::cout << "Shard " << i << ": ";
+        printDepth(q.shard(i));
+    }
+}
+
+template <typename Q, typename = void>
+struct has_stats : std::false_type {};
+
+template <typename Q>
+struct has_stats<Q, std::void_t<decltype(std::declval<Q&>().stats())>> : std::true_type {};
+
+// Contention events summed over every thread, zero unless the queue was
+// built with contention_stats (the 'stats' variant)
+template <typename Q>
+void printContention ( Q& q )
+{
+    if constexpr (has_stats<Q>::value)
+    {
+        mpmc_stats s = q.stats();
+        std::cout << "Contention: CAS failures = " << s.cas_failures
+                  << ", full = " << s.full
+                  << ", empty polls = " << s.empty
+                  << ", unpublished = " << s.unpublished << std::endl;
+    }
+}
+
+// Same as consumer() but claims up to batch messages with one
+// pop_bulk, so one transfer of m_deq_pos is shared by the whole batch.
+template <typename T, typename Q, typename WD>
+void consumer_bulk(Q* q, uint32_t batch, ResultsSync& rs, CycleTracker& ct, WD& wd)
+{
+	while (Thread::g_cstart.load() == false) {}
+
+	auto d = std::make_unique<T[]>(batch);
+	uint64_t start;
+
+	uint64_t c{0};
+
+    ct.start();
+	while(Thread::g_cstart)
+    {
+        CycleTracker::CheckPoint cp(ct, rs);
+        cp.markOne();
+
+        uint64_t n = q->pop_bulk(d.get(), batch);
+        if (n == 0)
+        {
+            cp.markTwo();
+            __builtin_ia32_pause();
+            continue;
+        }
+        cp.markTwo();
+
+        for (uint64_t m = 0; m < n; ++m)
+        {
+            start = getcc_ns();
+            for (uint32_t k = 0; k < d[m].get().workIterations; k++)
+            {
+                WD local_wd(wd);
+                while (getcc_ns() - start < d[m].get().workCycles){}
+                for (uint32_t it = 0; it < WriteWorkData::Elem; ++it)
+                    wd.wwd.data[it]++;
+            }
+        }
+        cp.markThree(n);
+		c += n;
+    }
+
 	Thread::g_recv+=c;
+	Thread::g_cdone++;
 	std::lock_guard<std::mutex> 
 		lock(Thread::g_cout_lock);
 	std::cout << "Recieved " << c << " messages " << std::endl;
 }
+
 // EX3: Begin
 //
 template <typename WD>
@@ -471,8 +641,8 @@ void setAffinity(
 	}
 }
 
-template<typename T,template<class...>typename Q>
-void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
+template<typename T,template<class...>typename Q, bool Blocking = false>
+void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations, uint32_t batch )
 {
     using WD_t = WorkData<alignof(T)>;
     // shared data amongst producers
@@ -490,6 +660,13 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
                 << sizeof(ResultsSync)
                 << std::endl;
 
+    if constexpr (has_cell_size<Q<T>>::value)
+    {
+        std::cout   << "Size of Cell_t = "
+                    << Q<T>::cell_size()
+                    << std::endl;
+    }
+
 	std::vector<std::unique_ptr<std::thread>> 
 		threads;
 	
@@ -508,6 +685,9 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
 	// consumers and producers
 	uint32_t iterations = 20'000'000;
 
+    Thread::g_pdone.store(0);
+    Thread::g_cdone.store(0);
+
     uint32_t core{0};
     uint32_t index{0};
     for (auto i : pc)
@@ -516,18 +696,35 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
         {
             threads.push_back(
                     std::make_unique<std::thread>
-                    (producer<T,Q<T>>
+                    (producer<T,Q<T>,Blocking>
                      , &q 
                      , iterations
                      , workCycles
                      , workIterations));
             setAffinity(*threads.rbegin(), core);
         }
+        else if (i == 'c' && batch > 1)
+        {
+            if constexpr (has_pop_bulk<Q<T>>::value)
+            {
+                threads.push_back(
+                        std::make_unique<std::thread>
+                        (consumer_bulk<T,Q<T>,WD_t>
+                         , &q
+                         , batch
+                         , std::ref(rs[index].get())
+                         , std::ref(ct[index].get())
+                         , std::ref(wd)));
+                ++index;
+
+                setAffinity(*threads.rbegin(), core);
+            }
+        }
         else if (i == 'c')
         {
             threads.push_back(
                     std::make_unique<std::thread>		  
-                    (consumer<T,Q<T>,WD_t>
+                    (consumer<T,Q<T>,WD_t,Blocking>
                      , &q
                      , iterations
                      , std::ref(rs[index].get())
@@ -575,10 +772,19 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
             std::cout << "Temporal: saturation [Cycles] = " << results[i].saturationCycles() << std::endl;
             std::cout << "Temporal: saturation [Ratio] =  " << results[i].saturationRatio() << std::endl;
             std::cout << "Spatial: Bandwidth [work/sec] = " << results[i].bandwidth() << std::endl;
+            if (Blocking)
+            {
+                uint64_t wakeups = ct[i].get().wakeups_.load(std::memory_order_relaxed);
+                uint64_t wakeCycles = ct[i].get().wakeCycles_.load(std::memory_order_relaxed);
+                std::cout << "Wait: wakeups = " << wakeups
+                          << ", avg wake cycles = " << (wakeups ? wakeCycles / wakeups : 0) << std::endl;
+            }
             totalBandwidth += results[i].bandwidth();
             // T1 End
         }
         std::cout << "Total Bandwidth = " << totalBandwidth << std::endl;
+        printDepth(q);
+        printContention(q);
         std::cout << "----" << std::endl << std::endl;
 
     }
@@ -589,9 +795,24 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
 
 
 	Thread::g_pstart.store(false);
+	// a producer stuck on a full ring needs the consumers to free a cell
+	// before it sees g_pstart, keep them running until it has returned
+	while (Thread::g_pdone.load() < std::count(pc.begin(), pc.end(), 'p'))
+		usleep(1000);
 	usleep(500000);
 	Thread::g_cstart.store(false);
 
+    // wake parked consumers so they see g_cstart, an empty message each.
+    // A full ring still has running consumers to free a cell, so retry
+    // until the push goes through or every consumer has returned.
+    if constexpr (Blocking)
+    {
+        for (uint32_t i = 0; i < index; ++i)
+        {
+            while (!q.push(T{}) && Thread::g_cdone.load() < index)
+                std::this_thread::yield();
+        }
+    }
     
 	for (auto& i : threads)
 	{
@@ -602,16 +823,1001 @@ void run ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
 	std::cout << "Total recv = " << Thread::g_recv << std::endl;
 }
 
+// Picks the producer/consumer cardinality of mpmc_queue at run time so
+// the compile time variants can be benchmarked against each other.
+template <typename T> using mpmc_spin_queue = mpmc_queue<T, busy_spin_wait>;
+template <typename T> using mpmc_yield_queue = mpmc_queue<T, spin_yield_wait>;
+template <typename T> using mpmc_backoff_queue = mpmc_queue<T, backoff_wait>;
+template <typename T> using mpmc_futex_queue = mpmc_queue<T, futex_wait>;
+template <typename T> using mpmc_swizzled_queue = mpmc_queue<T, swizzled_index>;
+template <typename T> using mpmc_stats_queue = mpmc_queue<T, contention_stats>;
+
+template<typename T>
+void runVariant ( const std::string& variant, const std::string& wait, const std::string& pc, uint64_t workCycles, uint32_t workIterations, uint32_t batch )
+{
+    auto producers = std::count(pc.begin(), pc.end(), 'p');
+    auto consumers = std::count(pc.begin(), pc.end(), 'c');
+
+    if (variant.size() == 4 && ((variant[0] == 's' && producers > 1) || (variant[2] == 's' && consumers > 1)))
+    {
+        std::cout << variant << " allows a single producer/consumer, got "
+                  << producers << "p/" << consumers << "c" << std::endl;
+        return;
+    }
+
+    if (wait != "poll")
+    {
+        if (variant != "mpmc" || batch > 1)
+            std::cout << "wait strategies are benchmarked on mpmc with batch 1" << std::endl;
+        else if (wait == "spin")
+            run<T, mpmc_spin_queue, true>(pc, workCycles, workIterations, batch);
+        else if (wait == "yield")
+            run<T, mpmc_yield_queue, true>(pc, workCycles, workIterations, batch);
+        else if (wait == "backoff")
+            run<T, mpmc_backoff_queue, true>(pc, workCycles, workIterations, batch);
+        else if (wait == "futex")
+            run<T, mpmc_futex_queue, true>(pc, workCycles, workIterations, batch);
+        else
+            std::cout << "unknown wait strategy " << wait << std::endl;
+    }
+    else if (variant == "spsc")
+        run<T, spsc_queue>(pc, workCycles, workIterations, batch);
+    else if (variant == "mpsc")
+        run<T, mpsc_queue>(pc, workCycles, workIterations, batch);
+    else if (variant == "spmc")
+        run<T, spmc_queue>(pc, workCycles, workIterations, batch);
+    else if (variant == "stats") // mpmc with contention counters
+        run<T, mpmc_stats_queue>(pc, workCycles, workIterations, batch);
+    else if (variant == "unbounded") // segments of 128 cells
+        run<T, mpmc_unbounded_queue>(pc, workCycles, workIterations, 1);
+    else if (variant == "sharded") // one 128 cell shard per hardware thread
+        run<T, mpmc_sharded_queue>(pc, workCycles, workIterations, 1);
+    else if (variant == "boost")
+        run<T, boost::lockfree::queue>(pc, workCycles, workIterations, 1);
+    else
+        run<T
+			//, boost::lockfree::queue> 
+			//, boost::lockfree::gqueue> 
+			//, boost::lockfree::bad_queue>
+			, mpmc_queue>
+                (pc, workCycles, workIterations, batch);
+}
+
+// Scaffold of the throughput modes: one thread per 'p' running
+// producer(core, stop) and one per 'c' running consumer(core, stop), each
+// pinned to its position in pc, all released at once. With seconds != 0
+// stop is raised after that long, otherwise the threads finish on their
+// own. Returns the seconds until the last thread is done.
+template <typename Producer, typename Consumer>
+double runThreads ( const std::string& pc, uint32_t seconds, Producer&& producer, Consumer&& consumer )
+{
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+
+    std::vector<std::unique_ptr<std::thread>> threads;
+
+    uint32_t core{0};
+    for (auto i : pc)
+    {
+        if (i == 'p' || i == 'c')
+        {
+            threads.push_back(std::make_unique<std::thread>([&, i, core]
+            {
+                while (!go.load()) {}
+                if (i == 'p')
+                    producer(core, stop);
+                else
+                    consumer(core, stop);
+            }));
+            setAffinity(*threads.rbegin(), core);
+        }
+
+        ++core;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true);
+
+    if (seconds != 0)
+    {
+        sleep(seconds);
+        stop.store(true);
+    }
+
+    for (auto& i : threads)
+        i->join();
+
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+    return secs.count();
+}
+
+// Throughput of one queue: every 'p' sends its share of messages with
+// push(n), n counting from 0, and the 'c's pop() until all of them are in.
+// Each thread calls its own copy of push or pop, so they may carry per
+// thread state. Returns messages per second.
+template <typename Push, typename Pop>
+double capacityThroughput ( const std::string& pc, uint64_t messages, Push&& push, Pop&& pop )
+{
+    uint64_t producers = std::count(pc.begin(), pc.end(), 'p');
+    uint64_t share = messages / producers;
+    uint64_t total = share * producers;
+
+    std::atomic<uint64_t> received{0};
+
+    double secs = runThreads(pc, 0,
+        [&] (uint32_t, const std::atomic<bool>&)
+        {
+            auto send = push;
+            for (uint64_t n = 0; n < share; ++n)
+                while (!send(n)) {}
+        },
+        [&] (uint32_t, const std::atomic<bool>&)
+        {
+            auto take = pop;
+            uint64_t local{0};
+            while (received.load(std::memory_order_relaxed) < total)
+            {
+                // count locally, publish on a dry poll or every 256
+                if (take() && (++local & 255) != 0)
+                    continue;
+                received.fetch_add(local, std::memory_order_relaxed);
+                local = 0;
+            }
+        });
+
+    return total / secs;
+}
+
+template <typename T, typename Q>
+double capacityThroughput ( Q& q, const std::string& pc, uint64_t messages )
+{
+    return capacityThroughput(pc, messages,
+        [&q, d = T()] (uint64_t) { return q.push(d); },
+        [&q, d = T()] () mutable { return q.pop(d); });
+}
+
+// Runtime sized mpmc_queue against mpmc_queue<T, capacity<N>> for each N
+template <typename T, uint64_t... Capacities>
+void runCapacitySweep ( const std::string& pc, std::integer_sequence<uint64_t, Capacities...> )
+{
+    constexpr uint64_t Messages = 20'000'000;
+
+    auto sweep = [&] (auto fixed)
+    {
+        using Fixed = mpmc_queue<T, capacity<decltype(fixed)::value>>;
+        constexpr uint64_t N = decltype(fixed)::value;
+
+        auto dynamicQ = std::make_unique<mpmc_queue<T>>(N);
+        double dynamicRate = capacityThroughput<T>(*dynamicQ, pc, Messages);
+
+        auto fixedQ = std::make_unique<Fixed>();
+        double fixedRate = capacityThroughput<T>(*fixedQ, pc, Messages);
+
+        std::cout << "capacity " << N
+                  << ": runtime [msgs/sec] = " << static_cast<uint64_t>(dynamicRate)
+                  << ", capacity<N> [msgs/sec] = " << static_cast<uint64_t>(fixedRate)
+                  << std::endl;
+    };
+
+    (sweep(std::integral_constant<uint64_t, Capacities>{}), ...);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Coroutine mode: the 'p's push from plain threads, the single 'c' runs a
+// mpmc_executor with one coroutine co_awaiting async_pop(). Compared with
+// the spin loop consumer on mpmc_queue for the per message overhead.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+mpmc_executor::task coroConsumer ( mpmc_async_queue<T>& q, uint64_t messages )
+{
+    for (uint64_t n = 0; n < messages; ++n)
+    {
+        T d = co_await q.async_pop();
+        (void)d;
+    }
+}
+
+// Returns messages per second, messages are split over the 'p's
+template <typename T>
+double coroThroughput ( mpmc_async_queue<T>& q, const std::string& pc, uint64_t messages )
+{
+    uint64_t producers = std::count(pc.begin(), pc.end(), 'p');
+    uint64_t share = messages / producers;
+
+    mpmc_executor exec;
+    exec.spawn(coroConsumer(q, share * producers));
+
+    double secs = runThreads(pc, 0,
+        [&] (uint32_t, const std::atomic<bool>&)
+        {
+            T d;
+            for (uint64_t n = 0; n < share; ++n)
+                while (!q.push(d)) {}
+        },
+        [&] (uint32_t, const std::atomic<bool>&)
+        {
+            exec.run();
+        });
+
+    return share * producers / secs;
+}
+
+template <typename T>
+void runCoro ( const std::string& pc )
+{
+    constexpr uint64_t Messages = 20'000'000;
+
+    if (std::count(pc.begin(), pc.end(), 'c') != 1 || std::count(pc.begin(), pc.end(), 'p') == 0)
+    {
+        std::cout << "coro takes producers and a single consumer" << std::endl;
+        return;
+    }
+
+    auto spinQ = std::make_unique<mpmc_queue<T>>(128);
+    double spinRate = capacityThroughput<T>(*spinQ, pc, Messages);
+
+    auto asyncQ = std::make_unique<mpmc_async_queue<T>>(128);
+    double coroRate = coroThroughput<T>(*asyncQ, pc, Messages);
+
+    std::cout << "spin loop consumer [msgs/sec] = " << static_cast<uint64_t>(spinRate)
+              << ", [ns/msg] = " << 1e9 / spinRate << std::endl;
+    std::cout << "coroutine consumer [msgs/sec] = " << static_cast<uint64_t>(coroRate)
+              << ", [ns/msg] = " << 1e9 / coroRate << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Persistent mode: mpmc_persistent_queue against the in-memory mpmc_queue,
+// and with variant 'kill' a producer/consumer process that is killed and
+// restarted on the same file.
+///////////////////////////////////////////////////////////////////////////////
+template <typename T>
+void runPersist ( const std::string& pc )
+{
+    constexpr uint64_t Messages = 20'000'000;
+    const std::string path = "mpmc_persist_bench.q";
+
+    auto memQ = std::make_unique<mpmc_queue<T>>(1024);
+    double memRate = capacityThroughput<T>(*memQ, pc, Messages);
+    std::cout << "in memory [msgs/sec] = " << static_cast<uint64_t>(memRate) << std::endl;
+
+    for (uint64_t flushEvery : {uint64_t{0}, uint64_t{1'000'000}, uint64_t{100'000}})
+    {
+        ::unlink(path.c_str());
+
+        auto fileQ = std::make_unique<mpmc_persistent_queue<T>>(path, 1024, flushEvery);
+        double fileRate = capacityThroughput<T>(*fileQ, pc, Messages);
+
+        std::cout << "file, msync every " << flushEvery << " pushes per thread [msgs/sec] = "
+                  << static_cast<uint64_t>(fileRate) << std::endl;
+    }
+
+    ::unlink(path.c_str());
+}
+
+// What the killed process last reported, in a mapping shared with it
+struct PersistControl
+{
+    std::atomic<uint64_t> next{1};      // first seq the producer sends
+    std::atomic<uint64_t> pushed{0};    // last seq pushed
+    std::atomic<uint64_t> popped{0};    // last seq popped
+    std::atomic<uint32_t> reopening{0}; // the recovering child is about to open the file
+};
+
+template <typename T>
+void persistChild ( const std::string& path, PersistControl* ctl )
+{
+    mpmc_persistent_queue<T> q(path, 1024);
+
+    std::thread consumer([&]
+    {
+        T d;
+        for(;;)
+        {
+            if (q.pop(d))
+                ctl->popped.store(d.get().seq, std::memory_order_relaxed);
+        }
+    });
+
+    T d;
+    for (uint64_t seq = ctl->next.load(); ; ++seq)
+    {
+        d.get().seq = seq;
+        while (!q.push(d)) {}
+        ctl->pushed.store(seq, std::memory_order_relaxed);
+    }
+}
+
+// Each round kills the child at a random point, then kills a second child
+// at a random point while it reopens the file and recovers the queue,
+// reopens the file itself and checks that what was recovered is one run of
+// consecutive seqs that starts right after the last message the consumer
+// got (or the one it was taking) and ends at the last one the producer
+// published.
+template <typename T>
+void runPersistKill ( uint32_t rounds )
+{
+    const std::string path = "mpmc_persist_kill.q";
+    ::unlink(path.c_str());
+
+    void* shared = ::mmap(nullptr, sizeof(PersistControl), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shared == MAP_FAILED)
+    {
+        std::cerr << "mmap of the control block failed: " << errno << std::endl;
+        return;
+    }
+
+    auto* ctl = new (shared) PersistControl;
+
+    uint32_t failed{0};
+
+    for (uint32_t r = 0; r < rounds; ++r)
+    {
+        ctl->pushed.store(ctl->next.load() - 1);
+        ctl->popped.store(ctl->next.load() - 1);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            persistChild<T>(path, ctl);
+            _exit(0);
+        }
+
+        usleep(100000 + rand() % 200000);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        uint64_t pushed = ctl->pushed.load();
+        uint64_t popped = ctl->popped.load();
+
+        // the recovery this one is cut short in has to be finished by the next
+        ctl->reopening.store(0);
+
+        pid = fork();
+        if (pid == 0)
+        {
+            ctl->reopening.store(1);
+            mpmc_persistent_queue<T> reopened(path, 1024);
+            _exit(0);
+        }
+
+        while (ctl->reopening.load() == 0)
+            std::this_thread::yield();
+
+        usleep(rand() % 200);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+
+        mpmc_persistent_queue<T> q(path, 1024);
+
+        T d;
+        uint64_t first{0};
+        uint64_t last{0};
+        bool ok = true;
+
+        while (q.pop(d))
+        {
+            uint64_t seq = d.get().seq;
+            if (first == 0)
+                first = seq;
+            else if (seq != last + 1)
+                ok = false;
+            last = seq;
+        }
+
+        if (first != 0)
+            ok = ok && first >= popped + 1 && first <= popped + 2 && last >= pushed && last <= pushed + 1;
+        else
+            ok = popped >= pushed;
+
+        failed += !ok;
+
+        std::cout << "round " << r << ": recovered " << q.recovered()
+                  << " [" << first << ", " << last << "]"
+                  << ", producer pushed " << pushed
+                  << ", consumer popped " << popped
+                  << (ok ? " ok" : " FAILED") << std::endl;
+
+        ctl->next.store(std::max(last, pushed) + 1);
+    }
+
+    std::cout << failed << " of " << rounds << " rounds failed" << std::endl;
+
+    ::munmap(ctl, sizeof(PersistControl));
+    ::unlink(path.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Conflate mode: price updates over ConflateKeys instruments, most of them
+// for a few hot ones, fed to consumers that spend workCycles on each.
+// mpmc_conflating_queue against mpmc_queue carrying every update.
+///////////////////////////////////////////////////////////////////////////////
+constexpr uint32_t ConflateKeys = 1024;
+constexpr uint32_t ConflateHotKeys = 16;
+
+struct Tick
+{
+    uint64_t stamp{0};
+    uint32_t key{0};
+    uint32_t price{0};
+};
+
+// 80% of the updates go to the hot keys
+inline uint32_t skewedKey ( uint64_t& rng )
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return (rng % 5 != 0) ? (rng >> 8) % ConflateHotKeys : (rng >> 8) % ConflateKeys;
+}
+
+struct ConflateResult
+{
+    uint64_t pushed{0};
+    uint64_t delivered{0};
+    uint64_t ageCycles{0};  // summed over the delivered updates
+    uint32_t seconds{0};
+};
+
+// Runs for ConflateSeconds, push(tick) and pop(tick) return false when
+// full / empty
+template <typename Push, typename Pop>
+ConflateResult conflateRun ( const std::string& pc, uint64_t workCycles, Push&& push, Pop&& pop )
+{
+    constexpr uint32_t ConflateSeconds = 2;
+
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> age{0};
+
+    runThreads(pc, ConflateSeconds,
+        [&] (uint32_t core, const std::atomic<bool>& stop)
+        {
+            uint64_t rng = 0x9e3779b97f4a7c15ull + core;
+            uint64_t n{0};
+            Tick t;
+
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                t.key = skewedKey(rng);
+                t.price = static_cast<uint32_t>(n);
+                t.stamp = getcc_ns();
+
+                while (!push(t) && !stop.load(std::memory_order_relaxed)) {}
+                ++n;
+            }
+
+            pushed.fetch_add(n);
+        },
+        [&] (uint32_t, const std::atomic<bool>& stop)
+        {
+            uint64_t n{0};
+            uint64_t cycles{0};
+            Tick t;
+
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                if (!pop(t))
+                    continue;
+
+                cycles += getcc_ns() - t.stamp;
+                ++n;
+
+                uint64_t start = getcc_ns();
+                while (getcc_ns() - start < workCycles){}
+            }
+
+            delivered.fetch_add(n);
+            age.fetch_add(cycles);
+        });
+
+    return ConflateResult{pushed.load(), delivered.load(), age.load(), ConflateSeconds};
+}
+
+void printConflate ( const std::string& tag, const ConflateResult& r )
+{
+    std::cout << tag << ": pushed [msgs/sec] = " << r.pushed / r.seconds
+              << ", delivered [msgs/sec] = " << r.delivered / r.seconds
+              << ", avg age [cycles] = " << (r.delivered ? r.ageCycles / r.delivered : 0)
+              << std::endl;
+}
+
+void runConflate ( const std::string& pc, uint64_t workCycles )
+{
+    mpmc_queue<Tick> plain(4096);
+    ConflateResult plainResult = conflateRun(pc, workCycles,
+        [&] (const Tick& t) { return plain.push(t); },
+        [&] (Tick& t) { return plain.pop(t); });
+
+    mpmc_conflating_queue<Tick> conflating(ConflateKeys);
+    ConflateResult conflatingResult = conflateRun(pc, workCycles,
+        [&] (const Tick& t) { conflating.push(t.key, t); return true; },
+        [&] (Tick& t) { uint32_t key; return conflating.pop(key, t); });
+
+    printConflate("mpmc_queue", plainResult);
+    printConflate("mpmc_conflating_queue", conflatingResult);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Credit mode: producers outpace consumers that spend workCycles per
+// message. Consumer throughput with the producers retrying pushes on the
+// full ring, against mpmc_credit_queue where they wait for credits.
+///////////////////////////////////////////////////////////////////////////////
+
+// Runs for CreditSeconds, returns messages per second the consumers got.
+// push(d) waits until the message is in, however it does that.
+template <typename T, typename Push, typename Pop>
+double creditThroughput ( const std::string& pc, uint64_t workCycles, Push&& push, Pop&& pop )
+{
+    constexpr uint32_t CreditSeconds = 2;
+
+    std::atomic<uint64_t> received{0};
+
+    runThreads(pc, CreditSeconds,
+        [&] (uint32_t, const std::atomic<bool>& stop)
+        {
+            T d;
+            while (!stop.load(std::memory_order_relaxed))
+                push(d, stop);
+        },
+        [&] (uint32_t, const std::atomic<bool>& stop)
+        {
+            T d;
+            uint64_t n{0};
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                if (!pop(d))
+                    continue;
+
+                ++n;
+
+                uint64_t start = getcc_ns();
+                while (getcc_ns() - start < workCycles){}
+            }
+            received.fetch_add(n);
+        });
+
+    return static_cast<double>(received.load()) / CreditSeconds;
+}
+
+template <typename T>
+void runCredit ( const std::string& pc, uint64_t workCycles, uint32_t batch )
+{
+    auto plain = std::make_unique<mpmc_queue<T>>(128);
+    double plainRate = creditThroughput<T>(pc, workCycles,
+        [&] (const T& d, const std::atomic<bool>& stop)
+        {
+            while (!plain->push(d) && !stop.load(std::memory_order_relaxed)) {}
+        },
+        [&] (T& d) { return plain->pop(d); });
+
+    auto credit = std::make_unique<mpmc_credit_queue<T>>(128, batch);
+    double creditRate = creditThroughput<T>(pc, workCycles,
+        [&] (const T& d, const std::atomic<bool>& stop)
+        {
+            // push_wait would sleep through stop once the consumers quit
+            for (uint32_t pauses = 1; !credit->push(d) && !stop.load(std::memory_order_relaxed);
+                 pauses = (pauses < 1024) ? pauses * 2 : pauses)
+            {
+                for (uint32_t i = 0; i < pauses; ++i)
+                    __builtin_ia32_pause();
+            }
+        },
+        [&] (T& d) { return credit->pop(d); });
+
+    std::cout << "spinning producers: consumers [msgs/sec] = " << static_cast<uint64_t>(plainRate) << std::endl;
+    std::cout << "credits, batch " << batch << ": consumers [msgs/sec] = " << static_cast<uint64_t>(creditRate) << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Variable size mode: a feed mixing 32 byte heartbeats, 256 byte quotes and
+// 1.5 KB snapshots through mpmc_byte_ring, against mpmc_queue with every
+// cell padded to the largest message. The byte ring gets the largest power
+// of 2 that fits in the memory of the fixed ring.
+///////////////////////////////////////////////////////////////////////////////
+struct FeedMessage
+{
+    enum Size : uint32_t { Heartbeat = 32, Quote = 256, Snapshot = 1536 };
+
+    uint32_t size{0};
+    unsigned char bytes[Snapshot];
+};
+
+// consumers read the last byte of every message into this
+thread_local uint64_t g_varsizeSink{0};
+
+// 80% heartbeats, 15% quotes, 5% snapshots, interleaved
+inline uint32_t feedSize ( uint64_t i )
+{
+    if (i % 20 == 0)
+        return FeedMessage::Snapshot;
+    if (i % 20 < 4)
+        return FeedMessage::Quote;
+    return FeedMessage::Heartbeat;
+}
+
+void runVarsize ( const std::string& pc )
+{
+    constexpr uint64_t Messages = 20'000'000;
+    constexpr uint64_t Cells = 128;
+
+    static const unsigned char source[FeedMessage::Snapshot] = {};
+
+    mpmc_queue<FeedMessage> fixed(Cells);
+    double fixedRate = capacityThroughput(pc, Messages,
+        [&] (uint64_t n)
+        {
+            auto slot = fixed.try_claim();
+            if (!slot)
+                return false;
+            // FeedMessage is not trivially default constructible, so it
+            // has to be emplaced before it is filled in
+            FeedMessage& m = slot.emplace();
+            m.size = feedSize(n);
+            std::memcpy(m.bytes, source, m.size);
+            return true;
+        },
+        [&]
+        {
+            auto slot = fixed.try_read();
+            if (!slot)
+                return false;
+            g_varsizeSink += slot->bytes[slot->size - 1];
+            return true;
+        });
+
+    uint64_t ringBytes{1};
+    while (ringBytes * 2 <= Cells * sizeof(FeedMessage))
+        ringBytes *= 2;
+
+    mpmc_byte_ring bytes(ringBytes);
+    double bytesRate = capacityThroughput(pc, Messages,
+        [&] (uint64_t n)
+        {
+            return bytes.push(source, feedSize(n));
+        },
+        [&]
+        {
+            return bytes.pop([&] (const void* data, uint32_t size)
+            {
+                g_varsizeSink += static_cast<const unsigned char*>(data)[size - 1];
+            });
+        });
+
+    std::cout << "mpmc_queue<" << sizeof(FeedMessage) << " byte cells> [msgs/sec] = " << static_cast<uint64_t>(fixedRate) << std::endl;
+    std::cout << "mpmc_byte_ring<" << ringBytes << " bytes> [msgs/sec] = " << static_cast<uint64_t>(bytesRate) << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Broadcast mode: the 'p' publishes into one mpmc_broadcast_ring and every
+// 'c' is a subscriber that sees the whole stream.
+///////////////////////////////////////////////////////////////////////////////
+struct alignas(64) BroadcastCounter
+{
+    std::atomic<uint64_t> c{0};
+};
+
+template <typename T, typename Ring>
+void broadcastSubscriber(Ring* ring, uint32_t reader, uint64_t workCycles, BroadcastCounter& recv)
+{
+    while (Thread::g_cstart.load() == false) {}
+
+    T d;
+    uint64_t c{0};
+
+    while (Thread::g_cstart)
+    {
+        if (!ring->pop(reader, d))
+        {
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        uint64_t start = getcc_ns();
+        while (getcc_ns() - start < workCycles){}
+
+        recv.c.store(++c, std::memory_order_relaxed);
+    }
+}
+
+template <typename T, typename Overflow>
+void runBroadcast ( const std::string& pc, uint64_t workCycles )
+{
+    using Ring = mpmc_broadcast_ring<T, Overflow>;
+
+    uint32_t subscribers = std::count(pc.begin(), pc.end(), 'c');
+
+    if (std::count(pc.begin(), pc.end(), 'p') != 1 || subscribers == 0)
+    {
+        std::cout << "broadcast takes one producer and at least one consumer" << std::endl;
+        return;
+    }
+
+    auto ring = std::make_unique<Ring>(128, subscribers);
+    auto recv = std::make_unique<BroadcastCounter[]>(subscribers);
+    BroadcastCounter sent;
+
+    std::vector<std::unique_ptr<std::thread>> threads;
+
+    uint32_t core{0};
+    uint32_t reader{0};
+    for (auto i : pc)
+    {
+        if (i == 'p')
+        {
+            threads.push_back(std::make_unique<std::thread>([&]
+            {
+                T d;
+                uint64_t c{0};
+
+                while (Thread::g_pstart.load() == false) {}
+
+                while (Thread::g_pstart)
+                {
+                    d.get().seq = c+1;
+                    if (ring->push(d))
+                        sent.c.store(++c, std::memory_order_relaxed);
+                    else
+                        __builtin_ia32_pause();
+                }
+            }));
+            setAffinity(*threads.rbegin(), core);
+        }
+        else if (i == 'c')
+        {
+            threads.push_back(std::make_unique<std::thread>(
+                      broadcastSubscriber<T, Ring>
+                    , ring.get()
+                    , reader
+                    , workCycles
+                    , std::ref(recv[reader])));
+            setAffinity(*threads.rbegin(), core);
+            ++reader;
+        }
+
+        ++core;
+    }
+
+    Thread::g_cstart.store(true);
+    usleep(500000);
+    Thread::g_pstart.store(true);
+
+    auto last = std::make_unique<uint64_t[]>(subscribers);
+    uint64_t lastSent{0};
+
+    for (int t = 0; t < 3600; ++t)
+    {
+        sleep(1);
+
+        uint64_t s = sent.c.load(std::memory_order_relaxed);
+
+        std::cout << "----" << std::endl;
+        std::cout << "Producer: Bandwidth [msg/sec] = " << s - lastSent << std::endl;
+        for (uint32_t i = 0; i < subscribers; ++i)
+        {
+            uint64_t r = recv[i].c.load(std::memory_order_relaxed);
+            std::cout << "Subscriber " << i << ": Bandwidth [msg/sec] = " << r - last[i]
+                      << ", lost = " << ring->lost(i) << std::endl;
+            last[i] = r;
+        }
+        std::cout << "----" << std::endl << std::endl;
+        lastSent = s;
+    }
+
+    Thread::g_pstart.store(false);
+    usleep(500000);
+    Thread::g_cstart.store(false);
+
+    for (auto& i : threads)
+        i->join();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Multi-process mode: every 'p' and 'c' is a forked process attaching to
+// one mpmc_queue inside a named POSIX shm region.
+///////////////////////////////////////////////////////////////////////////////
+struct ShmControl
+{
+    struct alignas(64) Counter
+    {
+        std::atomic<uint64_t> c{0};
+    };
+
+    enum Size : uint32_t { MaxProcs = 64 };
+
+    std::atomic<bool> pstart{false};
+    std::atomic<bool> cstart{false};
+    Counter send[MaxProcs];
+    Counter recv[MaxProcs];
+};
+
+constexpr uint64_t g_shmQueueOffset = (sizeof(ShmControl) + 4095) & ~uint64_t{4095};
+
+void setProcessAffinity ( uint32_t cpuid )
+{
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpuid, &cpuset);
+
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &cpuset) != 0)
+	{
+		std::cerr << "Error calling sched_setaffinity for cpu " << cpuid << "\n";
+		_exit(0);
+	}
+}
+
+template <typename T>
+void shmProcess(const std::string& name, char role, uint32_t slot, uint64_t workCycles, uint32_t workIterations)
+{
+	// attach by name rather than use the inherited mapping
+	auto region = shm_region::open(shm_region::Backing::PosixShm, name);
+	auto* ctl = static_cast<ShmControl*>(region.addr());
+	mpmc_queue<T> q(static_cast<char*>(region.addr()) + g_shmQueueOffset, region.size() - g_shmQueueOffset);
+
+	T d;
+	uint64_t c{0};
+
+	if (role == 'p')
+	{
+		d.get().workCycles = workCycles;
+		d.get().workIterations = workIterations;
+
+		while (ctl->pstart.load() == false) {}
+
+		while (ctl->pstart)
+		{
+			d.get().seq = c+1;
+			if (q.push(d))
+				ctl->send[slot].c.store(++c, std::memory_order_relaxed);
+			else
+				__builtin_ia32_pause();
+		}
+	}
+	else
+	{
+		while (ctl->cstart.load() == false) {}
+
+		while (ctl->cstart)
+		{
+			if (!q.pop(d))
+			{
+				__builtin_ia32_pause();
+				continue;
+			}
+
+			uint64_t start = getcc_ns();
+			while (getcc_ns() - start < uint64_t{d.get().workCycles} * d.get().workIterations){}
+
+			ctl->recv[slot].c.store(++c, std::memory_order_relaxed);
+		}
+	}
+}
+
+template <typename T>
+void runShm ( const std::string& pc, uint64_t workCycles, uint32_t workIterations )
+{
+	std::string name = "/mpmc_bench_" + std::to_string(getpid());
+
+	auto region = shm_region::create(
+			  shm_region::Backing::PosixShm
+			, name
+			, g_shmQueueOffset + mpmc_queue<T>::GetSize(128));
+
+	auto* ctl = new (region.addr()) ShmControl;
+	mpmc_queue<T> q(128, static_cast<char*>(region.addr()) + g_shmQueueOffset);
+
+	std::vector<pid_t> children;
+	uint32_t core{0};
+	uint32_t slot{0};
+
+	for (auto i : pc)
+	{
+		if ((i == 'p' || i == 'c') && slot < ShmControl::MaxProcs)
+		{
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				setProcessAffinity(core);
+				shmProcess<T>(name, i, slot, workCycles, workIterations);
+				_exit(0);
+			}
+			children.push_back(pid);
+			++slot;
+		}
+		++core;
+	}
+
+	ctl->cstart.store(true);
+	usleep(500000);
+	ctl->pstart.store(true);
+
+	uint64_t last{0};
+	for (int t = 0; t < 3600; ++t)
+	{
+		sleep(1);
+
+		uint64_t sent{0};
+		uint64_t recv{0};
+		for (uint32_t i = 0; i < slot; ++i)
+		{
+			sent += ctl->send[i].c.load(std::memory_order_relaxed);
+			recv += ctl->recv[i].c.load(std::memory_order_relaxed);
+		}
+
+		std::cout << "----" << std::endl;
+		std::cout << "Processes: Bandwidth [msg/sec] = " << recv - last << std::endl;
+		std::cout << "Total sent = " << sent << ", recv = " << recv << std::endl;
+		std::cout << "----" << std::endl << std::endl;
+		last = recv;
+	}
+
+	ctl->pstart.store(false);
+	usleep(500000);
+	ctl->cstart.store(false);
+
+	for (auto pid : children)
+		waitpid(pid, nullptr, 0);
+
+	region.unlink();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Priority check: lanes 0, 1 and 3 of a mpmc_priority_queue are kept busy
+// and the middle lane must get served under the steady urgent traffic.
+// Returns non-zero on failure.
+///////////////////////////////////////////////////////////////////////////////
+int checkPriorityStarvation ( )
+{
+    constexpr uint32_t Pops = 100'000;
+    constexpr uint32_t Busy[] = {0, 1, 3};
+
+    mpmc_priority_queue<uint32_t, 4> q(64);
+
+    for (uint32_t lane : Busy)
+        while (q.push(lane, lane)) {}
+
+    uint64_t served[4] = {};
+    uint32_t d;
+    uint32_t prio;
+
+    for (uint32_t i = 0; i < Pops; ++i)
+    {
+        if (!q.pop(d, &prio))
+        {
+            std::cout << "priocheck: queue ran dry" << std::endl;
+            return 1;
+        }
+
+        ++served[prio];
+        q.push(d, prio); // keep the lane busy
+    }
+
+    for (uint32_t lane = 0; lane < 4; ++lane)
+        std::cout << "lane " << lane << ": served " << served[lane] << std::endl;
+
+    // one pop in StarvationLimit + 1 is a starvation pick, shared by lanes 1 and 3
+    uint64_t fair = Pops / (decltype(q)::StarvationLimit + 1) / 2;
+    bool ok = served[1] >= fair && served[3] >= fair;
+
+    std::cout << "priocheck " << (ok ? "passed" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
 int main ( int argc, char* argv[] )
 {
 	if (argc < 3)
 	{
 		std::cout	<< "Usage: " 
 					<< argv[0] 
-					<< " <cl|nocl|SimpleCL|SimpleNOCL> "
+					<< " <cl|nocl|noclswz|capsweep|coro|persist|conflate|credit|varsize|broadcast|shm|priocheck|SimpleCL|SimpleNOCL> "
 					"<producer/consumer string (01ppcc67)> " 
                     "[optional] <work cycles> default=6000"
                     "[optional] <work iterations> default=10"
+                    "[optional] <consumer batch size> default=1"
+                    "[optional] <mpmc|spsc|mpsc|spmc|stats|sharded|unbounded|boost> default=mpmc (broadcast: <gate|overwrite>)"
+                    "[optional] <poll|spin|yield|backoff|futex> default=poll"
 					<< std::endl;
 		return 0;
 	}
@@ -626,6 +1832,21 @@ int main ( int argc, char* argv[] )
     if (argc >= 5)
         workIterations = atoi(argv[4]);
 
+    uint32_t batch = 1;
+
+    if (argc >= 6)
+        batch = atoi(argv[5]);
+
+    std::string variant{"mpmc"};
+
+    if (argc >= 7)
+        variant = argv[6];
+
+    std::string wait{"poll"};
+
+    if (argc >= 8)
+        wait = argv[7];
+
 
     std::string pc{argv[2]};
 
@@ -656,23 +1877,89 @@ int main ( int argc, char* argv[] )
 		
 	if (cl == "cl")
 	{
-		run<Alignment<
-			  Benchmark, 64>
-			//, boost::lockfree::queue> 
-			//, boost::lockfree::gqueue> 
-			, mpmc_queue> 
-                (pc, workCycles, workIterations);
+		runVariant<Alignment<
+			  Benchmark, 64>>
+                (variant, wait, pc, workCycles, workIterations, batch);
 	}
 	else if (cl == "nocl")
 	{
+		runVariant<Alignment<
+			  Benchmark 
+			, alignof(Benchmark)>>
+                (variant, wait, pc, workCycles, workIterations, batch);
+	}
+	else if (cl == "noclswz")
+	{
+		// packed cells like nocl, consecutive positions on different lines
 		run<Alignment<
 			  Benchmark 
 			, alignof(Benchmark)>
-			//, boost::lockfree::gqueue> 
-			//, boost::lockfree::bad_queue>
-			, mpmc_queue> 
+			, mpmc_swizzled_queue> 
+                (pc, workCycles, workIterations, batch);
+	}
+	else if (cl == "capsweep")
+	{
+		runCapacitySweep<Alignment<
+			  Benchmark, 64>>
+                (pc, std::integer_sequence<uint64_t, 16, 64, 256, 1024, 4096, 16384>{});
+	}
+	else if (cl == "coro")
+	{
+		runCoro<Alignment<
+			  Benchmark, 64>>
+				(pc);
+	}
+	else if (cl == "persist")
+	{
+		// variant 'kill' runs the kill and restart test instead
+		if (variant == "kill")
+			runPersistKill<Alignment<
+				  Benchmark, 64>>
+					(10);
+		else
+			runPersist<Alignment<
+				  Benchmark, 64>>
+					(pc);
+	}
+	else if (cl == "conflate")
+	{
+		runConflate(pc, workCycles);
+	}
+	else if (cl == "credit")
+	{
+		// the batch argument is the credit batch, 32 when not given
+		runCredit<Alignment<
+			  Benchmark, 64>>
+				(pc, workCycles, (batch > 1) ? batch : 32);
+	}
+	else if (cl == "varsize")
+	{
+		runVarsize(pc);
+	}
+	else if (cl == "broadcast")
+	{
+		// variant 'overwrite' lets the producer lap slow subscribers
+		if (variant == "overwrite")
+			runBroadcast<Alignment<
+				  Benchmark, 64>
+				, broadcast_overwrite>
+					(pc, workCycles);
+		else
+			runBroadcast<Alignment<
+				  Benchmark, 64>
+				, broadcast_gate>
+					(pc, workCycles);
+	}
+	else if (cl == "shm")
+	{
+		runShm<Alignment<
+			  Benchmark, 64>>
                 (pc, workCycles, workIterations);
 	}
+	else if (cl == "priocheck")
+	{
+		return checkPriorityStarvation();
+	}
 	else if (cl == "SimpleCL")
 	{
 		simpleTest<64>(pc);
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdint>
+
+#include <time.h>
+
 inline uint64_t getcc_ns ( void )
 {
 	unsigned cycles_low, cycles_high;
@@ -39,3 +43,43 @@ inline uint64_t getcc_e ( void )
 
 	return ((uint64_t)cycles_high << 32 | cycles_low);
 }
+
+// TSC ticks per nanosecond, measured once against CLOCK_MONOTONIC over
+// CalibrationNs. The first call pays for the measurement, so call it at
+// start up before the rate is needed on a hot path.
+inline double tsc_per_ns ( void )
+{
+	constexpr uint64_t CalibrationNs = 10'000'000;
+
+	static const double rate = []
+	{
+		auto now_ns = []
+		{
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+		};
+
+		uint64_t ns_start = now_ns();
+		uint64_t tsc_start = getcc_ns();
+		uint64_t ns_end;
+
+		do { ns_end = now_ns(); } while (ns_end - ns_start < CalibrationNs);
+
+		uint64_t tsc_end = getcc_ns();
+
+		return static_cast<double>(tsc_end - tsc_start) / (ns_end - ns_start);
+	}();
+
+	return rate;
+}
+
+inline uint64_t ns_to_tsc ( uint64_t ns )
+{
+	return static_cast<uint64_t>(ns * tsc_per_ns());
+}
+
+inline uint64_t tsc_to_ns ( uint64_t tsc )
+{
+	return static_cast<uint64_t>(tsc / tsc_per_ns());
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Backing storage options for an in-process mpmc_queue.
+struct mpmc_alloc
+{
+	// Map the ring with MAP_HUGETLB. When no huge pages are reserved the
+	// mapping falls back to normal pages with madvise(MADV_HUGEPAGE) so
+	// transparent huge pages can back it instead.
+	bool		huge_pages{false};
+
+	// Bind the ring to this NUMA node with mbind(MPOL_BIND), -1 leaves the
+	// kernel's first touch placement.
+	int			numa_node{-1};
+
+	// Threads used to construct (and so pre-fault) the cells. 0 picks one
+	// thread for small rings and all hardware threads for large ones.
+	uint32_t	init_threads{0};
+};
+
+namespace mpmc_detail
+{
+
+constexpr uint64_t HugePageSize = 2 * 1024 * 1024;
+
+// Ring sizes are powers of 2 (and at least 2) so a position maps to its
+// slot with a mask
+constexpr bool is_pow2(uint64_t s)
+{
+	return ((s >= 2) && !(s & (s - 1)));
+}
+
+// Returns a zeroed private mapping of at least size bytes, size is
+// updated to the length actually mapped.
+inline void* map(uint64_t& size, const mpmc_alloc& alloc)
+{
+	void* addr = MAP_FAILED;
+
+	if (alloc.huge_pages)
+	{
+		uint64_t huge_size = (size + HugePageSize - 1) & ~(HugePageSize - 1);
+
+		addr = ::mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (addr != MAP_FAILED)
+			size = huge_size;
+	}
+
+	if (addr == MAP_FAILED)
+	{
+		if (alloc.huge_pages)
+			size = (size + HugePageSize - 1) & ~(HugePageSize - 1);
+
+		addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (addr == MAP_FAILED)
+			throw std::system_error(errno, std::system_category(), "mpmc_queue: mmap");
+
+		// best effort, THP may be disabled on the host
+		if (alloc.huge_pages)
+			::madvise(addr, size, MADV_HUGEPAGE);
+	}
+
+	if (alloc.numa_node >= 0)
+	{
+		// mbind(2) without depending on libnuma
+		constexpr int MpolBind = 2;
+		constexpr unsigned MpolMfMove = 1 << 1;
+		constexpr uint64_t MaskBits = 8 * sizeof(unsigned long);
+
+		if (static_cast<uint64_t>(alloc.numa_node) >= MaskBits)
+		{
+			::munmap(addr, size);
+			throw std::system_error(EINVAL, std::system_category(), "mpmc_queue: numa node out of range");
+		}
+
+		unsigned long nodemask = 1UL << alloc.numa_node;
+
+		if (::syscall(SYS_mbind, addr, size, MpolBind, &nodemask, MaskBits, MpolMfMove) != 0)
+		{
+			int err = errno;
+			::munmap(addr, size);
+			throw std::system_error(err, std::system_category(), "mpmc_queue: mbind");
+		}
+	}
+
+	return addr;
+}
+
+inline void unmap(void* addr, uint64_t size)
+{
+	::munmap(addr, size);
+}
+
+} // mpmc_detail
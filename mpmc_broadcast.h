@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+
+#include "mpmc_alloc.h"
+
+// What the writer of a mpmc_broadcast_ring does when the slowest reader is
+// a full lap behind: broadcast_gate makes push() fail until it catches up,
+// broadcast_overwrite goes ahead and the lagging reader skips the messages
+// it lost.
+struct broadcast_gate		{ static constexpr bool overwrite = false; };
+struct broadcast_overwrite	{ static constexpr bool overwrite = true; };
+
+// Single writer, multi reader ring in the disruptor style: every reader sees
+// every message. The payload is written once into the ring and each reader
+// keeps its own cursor, so reading takes no CAS and readers never write a
+// line another reader reads. The writer caches the slowest cursor and only
+// rescans the readers when the cached one says the ring is full.
+//
+// Each cell carries a seqlock style sequence: 2*pos+1 while the writer
+// fills it for position pos and 2*pos+2 once published. In overwrite mode a
+// reader copies the payload and re-checks the sequence, T must then be
+// trivially copyable since a copy may race the writer.
+//
+// The number of readers is fixed at construction and every reader starts
+// at position 0. Reader i must only be used by one thread at a time.
+template<typename T, typename Overflow = broadcast_gate>
+class mpmc_broadcast_ring
+{
+	static_assert(!Overflow::overwrite || std::is_trivially_copyable<T>::value,
+				  "overwriting readers copy racing the writer, T must be trivially copyable");
+
+public:
+	mpmc_broadcast_ring(uint64_t q_elements, uint32_t readers)
+		: m_mask(q_elements - 1)
+		, m_readers(readers)
+		, m_cells(new Cell_t[q_elements])
+		, m_cursors(new cursor[readers])
+	{
+		assert(mpmc_detail::is_pow2(q_elements));
+		assert(readers >= 1);
+	}
+
+	uint64_t capacity() const { return m_mask + 1; }
+	uint32_t readers() const { return m_readers; }
+
+	// Writer side, one thread only. Fails when gating and the slowest
+	// reader has not finished with the cell a lap back.
+	bool push(const T& data)
+	{
+		uint64_t pos = m_pos;
+
+		if constexpr (!Overflow::overwrite)
+		{
+			if (pos - m_gate > m_mask)
+			{
+				m_gate = slowest();
+
+				if (pos - m_gate > m_mask)
+					return false;
+			}
+		}
+
+		Cell_t& cell = m_cells[pos & m_mask];
+
+		if constexpr (Overflow::overwrite)
+		{
+			// readers still on the previous lap see the cell change under them
+			cell.m_seq.store(2 * pos + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+
+		cell.m_data = data;
+		cell.m_seq.store(2 * pos + 2, std::memory_order_release);
+
+		m_pos = pos + 1;
+
+		if constexpr (Overflow::overwrite)
+			m_published.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Reader side: copies reader's next message into data, false when it
+	// has seen everything published so far.
+	bool pop(uint32_t reader, T& data)
+	{
+		cursor& c = m_cursors[reader];
+
+		for(;;)
+		{
+			uint64_t pos = c.m_pos.load(std::memory_order_relaxed);
+			Cell_t& cell = m_cells[pos & m_mask];
+			uint64_t seq = cell.m_seq.load(std::memory_order_acquire);
+
+			if (seq < 2 * pos + 2)
+				return false;
+
+			if constexpr (Overflow::overwrite)
+			{
+				if (seq == 2 * pos + 2)
+				{
+					data = cell.m_data;
+					std::atomic_thread_fence(std::memory_order_acquire);
+
+					if (cell.m_seq.load(std::memory_order_relaxed) == seq)
+					{
+						c.m_pos.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+
+				// lapped, skip to the oldest message still in the ring
+				skip(c, pos);
+				continue;
+			}
+
+			data = cell.m_data;
+			c.m_pos.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+	}
+
+	// Reader side, zero copy: calls f(const T&) on reader's next message in
+	// the ring. Only when gating, an overwriting writer may change the cell
+	// while f looks at it.
+	template <typename F>
+	bool read(uint32_t reader, F&& f)
+	{
+		static_assert(!Overflow::overwrite, "use pop() with broadcast_overwrite");
+
+		cursor& c = m_cursors[reader];
+		uint64_t pos = c.m_pos.load(std::memory_order_relaxed);
+		Cell_t& cell = m_cells[pos & m_mask];
+
+		if (cell.m_seq.load(std::memory_order_acquire) != 2 * pos + 2)
+			return false;
+
+		f(static_cast<const T&>(cell.m_data));
+		c.m_pos.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Messages reader skipped because the writer overwrote them
+	uint64_t lost(uint32_t reader) const
+	{
+		return m_cursors[reader].m_lost.load(std::memory_order_relaxed);
+	}
+
+	// Next position reader will read
+	uint64_t position(uint32_t reader) const
+	{
+		return m_cursors[reader].m_pos.load(std::memory_order_relaxed);
+	}
+
+private:
+	uint64_t slowest() const
+	{
+		uint64_t min = m_cursors[0].m_pos.load(std::memory_order_acquire);
+
+		for (uint32_t i = 1; i < m_readers; ++i)
+			min = std::min(min, m_cursors[i].m_pos.load(std::memory_order_acquire));
+
+		return min;
+	}
+
+	struct alignas(64) cursor
+	{
+		std::atomic<uint64_t>	m_pos{0};
+		std::atomic<uint64_t>	m_lost{0};
+	};
+
+	void skip(cursor& c, uint64_t pos)
+	{
+		uint64_t head = m_published.load(std::memory_order_acquire);
+		uint64_t oldest = (head > capacity()) ? head - capacity() : 0;
+
+		if (oldest <= pos)
+			oldest = pos + 1; // the writer is mid lap on our cell, drop just it
+
+		c.m_lost.store(c.m_lost.load(std::memory_order_relaxed) + (oldest - pos), std::memory_order_relaxed);
+		c.m_pos.store(oldest, std::memory_order_release);
+	}
+
+	struct alignas(alignof(T)) Cell_t
+	{
+		std::atomic<uint64_t>	m_seq{0};
+		T						m_data{};
+	};
+
+	const uint64_t				m_mask;
+	const uint32_t				m_readers;
+	std::unique_ptr<Cell_t[]>	m_cells;
+	std::unique_ptr<cursor[]>	m_cursors;
+
+	// writer only
+	alignas(64) uint64_t		m_pos{0};
+	uint64_t					m_gate{0}; // slowest cursor when last scanned
+
+	// overwrite mode, read by readers that were lapped
+	alignas(64) std::atomic<uint64_t>	m_published{0};
+
+	mpmc_broadcast_ring(const mpmc_broadcast_ring&) = delete;
+	void operator = (const mpmc_broadcast_ring&) = delete;
+};
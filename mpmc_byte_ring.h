@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include "mpmc_alloc.h"
+
+// MPMC ring of variable length records, for streams that mix small and
+// large messages where mpmc_queue would pad every cell to the largest.
+//
+// Records are a 16 byte header followed by the payload, rounded up to
+// RecordAlign, and never wrap: a record that does not fit before the end
+// of the buffer is placed at the start and the tail is filled with a
+// padding record that consumers skip. Producers claim space with a CAS on
+// m_enq and consumers claim whole records with a CAS on m_deq, records
+// come out in the order they were claimed.
+//
+// A header's tag is (pos << 2) | state, pos being the record's absolute
+// byte position, so a header left over from an earlier lap never matches.
+// Consumers release records out of order; the space only returns to the
+// producers when m_free moves over it, which the releaser of the oldest
+// record does for every released record behind it. Reclaimed records are
+// zeroed so payload bytes are never mistaken for a header on the next lap.
+class mpmc_byte_ring
+{
+	struct header
+	{
+		std::atomic<uint64_t>	m_tag;
+		uint32_t				m_bytes;	// whole record, header and padding included
+		uint32_t				m_size;		// payload
+	};
+
+	enum State : uint64_t { Ready = 1, Pad = 2, Released = 3 };
+
+	static constexpr uint64_t align_up(uint64_t v, uint64_t a)
+	{
+		return (v + a - 1) & ~(a - 1);
+	}
+
+public:
+	// MaxRecord is the longest record header::m_bytes can hold
+	enum Layout : uint32_t { RecordAlign = 16, HeaderSize = sizeof(header), MaxRecord = UINT32_MAX & ~(RecordAlign - 1) };
+
+	static_assert(sizeof(header) == 16, "header is one record granule");
+
+	// bytes is the ring size, a power of 2. The mapping is zeroed, every
+	// tag starts out matching no position.
+	mpmc_byte_ring(uint64_t bytes, const mpmc_alloc& alloc = mpmc_alloc())
+		: m_mask(bytes - 1)
+		, m_map_size(bytes)
+	{
+		if (!mpmc_detail::is_pow2(bytes) || bytes < 2 * RecordAlign)
+			throw std::invalid_argument("mpmc_byte_ring: size must be a power of 2");
+
+		m_map = static_cast<unsigned char*>(mpmc_detail::map(m_map_size, alloc));
+	}
+
+	~mpmc_byte_ring()
+	{
+		mpmc_detail::unmap(m_map, m_map_size);
+	}
+
+	uint64_t capacity() const { return m_mask + 1; }
+
+	// Largest payload a record can carry. Up to half the ring, so a record
+	// that has to skip the tail of the buffer still fits, and no more than
+	// the 32 bit record length allows on rings of 8 GB and up.
+	uint64_t max_size() const { return std::min<uint64_t>(capacity() / 2, MaxRecord) - HeaderSize; }
+
+	// Space claimed by claim(), filled in through data() and published by
+	// commit() or the destructor.
+	class write_slot
+	{
+	public:
+		write_slot() = default;
+
+		write_slot(write_slot&& s)
+			: m_header(std::exchange(s.m_header, nullptr))
+			, m_pos(s.m_pos)
+		{}
+
+		write_slot& operator = (write_slot&& s)
+		{
+			if (&s != this)
+			{
+				commit();
+				m_header = std::exchange(s.m_header, nullptr);
+				m_pos = s.m_pos;
+			}
+			return *this;
+		}
+
+		~write_slot() { commit(); }
+
+		explicit operator bool() const { return m_header != nullptr; }
+
+		void* data() const { return reinterpret_cast<unsigned char*>(m_header) + HeaderSize; }
+		uint32_t size() const { return m_header->m_size; }
+
+		void commit()
+		{
+			if (!m_header)
+				return;
+
+			m_header->m_tag.store((m_pos << 2) | Ready, std::memory_order_release);
+			m_header = nullptr;
+		}
+
+	private:
+		friend class mpmc_byte_ring;
+
+		write_slot(header* h, uint64_t pos)
+			: m_header(h)
+			, m_pos(pos)
+		{}
+
+		header*		m_header{nullptr};
+		uint64_t	m_pos{0};
+	};
+
+	// A published record claimed by try_read(), read in place. release() (or
+	// the destructor) hands the space back.
+	class read_slot
+	{
+	public:
+		read_slot() = default;
+
+		read_slot(read_slot&& s)
+			: m_ring(s.m_ring)
+			, m_header(std::exchange(s.m_header, nullptr))
+			, m_pos(s.m_pos)
+		{}
+
+		read_slot& operator = (read_slot&& s)
+		{
+			if (&s != this)
+			{
+				release();
+				m_ring = s.m_ring;
+				m_header = std::exchange(s.m_header, nullptr);
+				m_pos = s.m_pos;
+			}
+			return *this;
+		}
+
+		~read_slot() { release(); }
+
+		explicit operator bool() const { return m_header != nullptr; }
+
+		const void* data() const { return reinterpret_cast<const unsigned char*>(m_header) + HeaderSize; }
+		uint32_t size() const { return m_header->m_size; }
+
+		void release()
+		{
+			if (!m_header)
+				return;
+
+			m_ring->release(m_pos);
+			m_header = nullptr;
+		}
+
+	private:
+		friend class mpmc_byte_ring;
+
+		read_slot(mpmc_byte_ring* ring, header* h, uint64_t pos)
+			: m_ring(ring)
+			, m_header(h)
+			, m_pos(pos)
+		{}
+
+		mpmc_byte_ring*	m_ring{nullptr};
+		header*			m_header{nullptr};
+		uint64_t		m_pos{0};
+	};
+
+	// Claims a record with a size byte payload, empty when the ring has no
+	// room for it (or size is over max_size()).
+	write_slot claim(uint64_t size)
+	{
+		uint64_t bytes = align_up(HeaderSize + size, RecordAlign);
+
+		if (size > max_size())
+			return write_slot();
+
+		uint64_t enq = m_enq.load(std::memory_order_relaxed);
+		uint64_t pad;
+
+		for(;;)
+		{
+			uint64_t tail = capacity() - (enq & m_mask);
+			pad = (bytes > tail) ? tail : 0;
+
+			if (enq + pad + bytes > m_free.load(std::memory_order_acquire) + capacity())
+				return write_slot(); // full
+
+			// on failure enq is refreshed with the current m_enq
+			if (m_enq.compare_exchange_weak(enq, enq + pad + bytes, std::memory_order_relaxed))
+				break;
+		}
+
+		if (pad)
+		{
+			header* p = at(enq);
+			p->m_bytes = pad;
+			p->m_size = 0;
+			p->m_tag.store((enq << 2) | Pad, std::memory_order_release);
+			enq += pad;
+		}
+
+		header* h = at(enq);
+		h->m_bytes = bytes;
+		h->m_size = size;
+
+		return write_slot(h, enq);
+	}
+
+	bool push(const void* data, uint64_t size)
+	{
+		write_slot s = claim(size);
+
+		if (!s)
+			return false;
+
+		std::memcpy(s.data(), data, size);
+		return true;
+	}
+
+	// Claims the oldest published record, empty when there is none yet.
+	read_slot try_read()
+	{
+		uint64_t deq = m_deq.load(std::memory_order_relaxed);
+
+		for(;;)
+		{
+			header* h = at(deq);
+			uint64_t tag = h->m_tag.load(std::memory_order_acquire);
+			uint64_t state = tag & 3;
+
+			if ((tag >> 2) != deq || (state != Ready && state != Pad))
+			{
+				// not published yet, or deq is stale and the record taken
+				uint64_t now = m_deq.load(std::memory_order_relaxed);
+
+				if (now == deq)
+					return read_slot();
+
+				deq = now;
+				continue;
+			}
+
+			uint64_t next = deq + h->m_bytes;
+
+			// on failure deq is refreshed with the current m_deq
+			if (!m_deq.compare_exchange_weak(deq, next, std::memory_order_relaxed))
+				continue;
+
+			if (state == Ready)
+				return read_slot(this, h, deq);
+
+			release(deq);
+			deq = next;
+		}
+	}
+
+	// Calls f(const void*, uint32_t size) on the oldest record in place
+	template <typename F>
+	bool pop(F&& f)
+	{
+		read_slot s = try_read();
+
+		if (!s)
+			return false;
+
+		f(s.data(), s.size());
+		return true;
+	}
+
+private:
+	header* at(uint64_t pos) const
+	{
+		return reinterpret_cast<header*>(m_map + (pos & m_mask));
+	}
+
+	// Marks the record at pos released, then moves m_free over every
+	// released record from m_free on. Taking a record's tag from Released to
+	// 0 makes the caller its only reclaimer. The seq_cst tag store / m_free
+	// load here and m_free store / tag load in the loop make sure that a
+	// release racing a reclaimer is either seen by it or reclaims itself.
+	void release(uint64_t pos)
+	{
+		at(pos)->m_tag.store((pos << 2) | Released, std::memory_order_seq_cst);
+
+		uint64_t free = m_free.load(std::memory_order_seq_cst);
+
+		for(;;)
+		{
+			header* h = at(free);
+			uint64_t expected = (free << 2) | Released;
+
+			if (!h->m_tag.compare_exchange_strong(expected, 0, std::memory_order_seq_cst))
+				return;
+
+			uint64_t bytes = h->m_bytes;
+			std::memset(reinterpret_cast<unsigned char*>(h) + sizeof(h->m_tag), 0, bytes - sizeof(h->m_tag));
+
+			free += bytes;
+			m_free.store(free, std::memory_order_seq_cst);
+		}
+	}
+
+	const uint64_t		m_mask;
+	unsigned char*		m_map{nullptr};
+	uint64_t			m_map_size;
+
+	alignas(64) std::atomic<uint64_t>	m_enq{0};	// next byte producers claim
+	alignas(64) std::atomic<uint64_t>	m_deq{0};	// next record consumers claim
+	alignas(64) std::atomic<uint64_t>	m_free{0};	// end of the space given back
+
+	mpmc_byte_ring(const mpmc_byte_ring&) = delete;
+	void operator = (const mpmc_byte_ring&) = delete;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+#include "mpmc_q.h"
+
+// Queue of per key updates where only the newest value of a key matters,
+// e.g. prices per instrument. Keys are dense, [0, keys). Each key has one
+// slot holding its latest value, and the key is queued in an mpmc_queue of
+// key ids the first time it gets a value nobody has taken yet. Further
+// pushes for the key overwrite the slot in place, so however far behind
+// consumers fall there are at most keys entries outstanding, delivered in
+// order of first arrival and each with the newest value.
+//
+// A slot is a seqlock: m_seq is odd while a producer writes it. Consumers
+// clear m_pending before they read the slot, so a push that lands after
+// the read queues the key again. A consumer only delivers a value whose
+// sequence is newer than the last one delivered for the key, so a key
+// queued again after its newest value was already taken is skipped.
+// T must be trivially copyable since a read may race a writer.
+template<typename T, typename Queue = mpmc_queue<uint32_t>>
+class mpmc_conflating_queue
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "readers copy racing the writers, T must be trivially copyable");
+
+	static uint64_t ring_size(uint32_t keys)
+	{
+		uint64_t s = 2;
+		while (s < keys)
+			s *= 2;
+		return s;
+	}
+
+public:
+	explicit mpmc_conflating_queue(uint32_t keys)
+		: m_keys(keys)
+		, m_slots(new slot[keys])
+		, m_queue(ring_size(keys))
+	{
+		assert(keys >= 1);
+	}
+
+	uint32_t keys() const { return m_keys; }
+
+	// Stores data as the newest value of key. Never fails: a key is queued
+	// at most once, so the ring of keys only fills for as long as a consumer
+	// is between taking a key and releasing its cell.
+	void push(uint32_t key, const T& data)
+	{
+		slot& s = m_slots[key];
+		uint64_t seq = s.m_seq.load(std::memory_order_relaxed);
+
+		for(;;)
+		{
+			if (seq & 1)
+			{
+				__builtin_ia32_pause();
+				seq = s.m_seq.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			// on failure seq is refreshed with the slot's current sequence
+			if (s.m_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed))
+				break;
+		}
+
+		// readers see the slot change under them
+		std::atomic_thread_fence(std::memory_order_release);
+
+		s.m_value = data;
+		s.m_seq.store(seq + 2, std::memory_order_release);
+
+		if (s.m_pending.exchange(1, std::memory_order_acq_rel) == 0)
+		{
+			while (!m_queue.push(key))
+				__builtin_ia32_pause();
+		}
+	}
+
+	// Takes the key that got its first pending update longest ago, with
+	// that key's newest value. False when no key has an update pending.
+	bool pop(uint32_t& key, T& data)
+	{
+		uint32_t k;
+
+		while (m_queue.pop(k))
+		{
+			slot& s = m_slots[k];
+
+			// pairs with the exchange in push(): either we read its value
+			// or it queues the key again
+			s.m_pending.exchange(0, std::memory_order_acq_rel);
+
+			uint64_t seq;
+
+			for(;;)
+			{
+				seq = s.m_seq.load(std::memory_order_acquire);
+
+				if (seq & 1)
+				{
+					__builtin_ia32_pause();
+					continue;
+				}
+
+				data = s.m_value;
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (s.m_seq.load(std::memory_order_relaxed) == seq)
+					break;
+			}
+
+			uint64_t delivered = s.m_delivered.load(std::memory_order_relaxed);
+
+			// on failure delivered is refreshed with the slot's current one
+			while (delivered < seq && !s.m_delivered.compare_exchange_weak(delivered, seq, std::memory_order_relaxed))
+			{}
+
+			if (delivered >= seq)
+				continue; // this value, or a newer one, went to someone else
+
+			key = k;
+			return true;
+		}
+
+		return false;
+	}
+
+private:
+	struct alignas(64) slot
+	{
+		std::atomic<uint64_t>	m_seq{0};
+		std::atomic<uint64_t>	m_delivered{0};	// m_seq of the last value taken
+		std::atomic<uint32_t>	m_pending{0};	// key is in m_queue
+		T						m_value{};
+	};
+
+	const uint32_t				m_keys;
+	std::unique_ptr<slot[]>		m_slots;
+	Queue						m_queue;
+
+	mpmc_conflating_queue(const mpmc_conflating_queue&) = delete;
+	void operator = (const mpmc_conflating_queue&) = delete;
+};
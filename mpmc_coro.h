@@ -0,0 +1,371 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "mpmc_q.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// C++20 coroutine support: co_await q.async_pop() / q.async_push(v) on a
+// mpmc_async_queue, run by a single threaded mpmc_executor.
+//
+// An awaitable completes straight away when the queue allows it. Otherwise
+// it links itself, it lives in the awaiting coroutine's frame so nothing is
+// allocated per operation, into a waiter list in the queue's coro_wait
+// channel. The other side's notify() unlinks as many waiters as it made
+// cells/elements available and posts them to their executors, which retry
+// the operation and resume the coroutine, or link it again if another
+// thread got there first.
+///////////////////////////////////////////////////////////////////////////////
+class mpmc_executor;
+
+struct coro_waiter
+{
+	// Attempts the operation, true when it completed
+	bool (*m_try)(coro_waiter*){nullptr};
+
+	std::coroutine_handle<>	m_handle;
+	mpmc_executor*			m_exec{nullptr};
+	coro_waiter*			m_next{nullptr};
+
+	bool	m_linked{false};	// guarded by the channel lock
+	bool	m_done{false};		// only touched on the executor's thread
+};
+
+// Wait strategy holding coroutine waiters. The channel holds pointers into
+// coroutine frames, so queues using it are in process only. push_wait and
+// pop_wait on such a queue spin and yield like spin_yield_wait.
+struct coro_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = false;
+	static constexpr uint32_t id = 6;
+
+	struct alignas(64) channel
+	{
+		std::atomic<bool>		m_lock{false};
+		std::atomic<uint32_t>	m_waiters{0};
+		coro_waiter*			m_head{nullptr};
+		coro_waiter*			m_tail{nullptr};
+
+		void lock()
+		{
+			while (m_lock.exchange(true, std::memory_order_acquire))
+				__builtin_ia32_pause();
+		}
+
+		void unlock()
+		{
+			m_lock.store(false, std::memory_order_release);
+		}
+
+		void link(coro_waiter* w)
+		{
+			w->m_next = nullptr;
+			w->m_linked = true;
+
+			if (m_tail)
+				m_tail->m_next = w;
+			else
+				m_head = w;
+
+			m_tail = w;
+			m_waiters.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void unlink(coro_waiter* w)
+		{
+			coro_waiter** p = &m_head;
+			coro_waiter* prev = nullptr;
+
+			while (*p != w)
+			{
+				prev = *p;
+				p = &(*p)->m_next;
+			}
+
+			*p = w->m_next;
+			if (m_tail == w)
+				m_tail = prev;
+
+			w->m_linked = false;
+			m_waiters.fetch_sub(1, std::memory_order_relaxed);
+		}
+	};
+
+	static void notify(channel& c, uint64_t count = 1);
+
+	template <typename Op>
+	static void wait(channel&, Op&& op, wait_stats*)
+	{
+		spin_yield_wait::channel c;
+		spin_yield_wait::wait(c, std::forward<Op>(op), nullptr);
+	}
+
+	// Links w and retries its operation once more, pairing with the fence in
+	// notify(). Returns true when w stays suspended: either it is linked, or
+	// it completed but a notifier had already unlinked it and posted it, in
+	// which case the posted run resumes it.
+	static bool suspend(channel& c, coro_waiter* w)
+	{
+		c.lock();
+		c.link(w);
+		c.unlock();
+
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (!w->m_try(w))
+			return true;
+
+		c.lock();
+		bool mine = w->m_linked;
+		if (mine)
+			c.unlink(w);
+		c.unlock();
+
+		if (mine)
+			return false;
+
+		w->m_done = true;
+		return true;
+	}
+};
+
+// Runs coroutines on the thread that calls run(). Other threads hand it
+// work through post(), which goes through a mpmc_queue sized at
+// construction and spins while that is full, so the run queue must be
+// larger than the number of coroutines that can be waiting at once. An
+// idle executor spins, then yields between polls.
+class mpmc_executor
+{
+public:
+	struct task_item
+	{
+		void (*m_fn)(void*, void*){nullptr};
+		void*	m_arg{nullptr};
+		void*	m_ctx{nullptr};
+	};
+
+	// Fire and forget coroutine, started with spawn(). The frame is freed
+	// when the coroutine returns.
+	struct task
+	{
+		struct promise_type
+		{
+			mpmc_executor* m_exec{nullptr};
+
+			task get_return_object() { return task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+
+			std::suspend_never final_suspend() noexcept
+			{
+				m_exec->m_live.fetch_sub(1, std::memory_order_release);
+				return {};
+			}
+
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+
+		std::coroutine_handle<promise_type> m_handle;
+	};
+
+	explicit mpmc_executor(uint64_t run_queue = 1024)
+		: m_ready(run_queue)
+	{}
+
+	// The executor running on this thread, null outside run()
+	static mpmc_executor*& current()
+	{
+		thread_local mpmc_executor* exec{nullptr};
+		return exec;
+	}
+
+	void spawn(task t)
+	{
+		t.m_handle.promise().m_exec = this;
+		m_live.fetch_add(1, std::memory_order_relaxed);
+		post(&resume_handle, t.m_handle.address());
+	}
+
+	void post(void (*fn)(void*, void*), void* arg, void* ctx = nullptr)
+	{
+		while (!m_ready.push(task_item{fn, arg, ctx}))
+			std::this_thread::yield();
+	}
+
+	// Runs until every spawned coroutine has returned
+	void run()
+	{
+		current() = this;
+
+		task_item item;
+		uint32_t idle{0};
+
+		while (m_live.load(std::memory_order_acquire) != 0)
+		{
+			if (m_ready.pop(item))
+			{
+				item.m_fn(item.m_arg, item.m_ctx);
+				idle = 0;
+			}
+			else if (++idle < spin_yield_wait::SpinLimit)
+				__builtin_ia32_pause();
+			else
+				std::this_thread::yield();
+		}
+
+		current() = nullptr;
+	}
+
+private:
+	static void resume_handle(void* address, void*)
+	{
+		std::coroutine_handle<>::from_address(address).resume();
+	}
+
+	mpmc_queue<task_item>	m_ready;
+	std::atomic<uint64_t>	m_live{0};
+};
+
+// Posted by notify() for an unlinked waiter, runs on its executor
+inline void coro_wait_run(void* waiter, void* chan)
+{
+	auto* w = static_cast<coro_waiter*>(waiter);
+
+	if (w->m_done || w->m_try(w) || !coro_wait::suspend(*static_cast<coro_wait::channel*>(chan), w))
+		w->m_handle.resume();
+}
+
+inline void coro_wait::notify(channel& c, uint64_t count)
+{
+	// pairs with the fence in suspend(): either we see the waiter or it
+	// sees what we just published
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (c.m_waiters.load(std::memory_order_relaxed) == 0)
+		return;
+
+	coro_waiter* woken{nullptr};
+
+	c.lock();
+	for (; count != 0 && c.m_head; --count)
+	{
+		coro_waiter* w = c.m_head;
+		c.unlink(w);
+		w->m_next = woken;
+		woken = w;
+	}
+	c.unlock();
+
+	while (woken)
+	{
+		coro_waiter* w = woken;
+		woken = w->m_next;
+		w->m_exec->post(&coro_wait_run, w, &c);
+	}
+}
+
+// mpmc_queue with the coro_wait strategy and the awaitables on top.
+// Awaiting coroutines must run on a mpmc_executor.
+template<typename T, typename... Options>
+class mpmc_async_queue : public mpmc_queue<T, coro_wait, Options...>
+{
+	using base = mpmc_queue<T, coro_wait, Options...>;
+
+public:
+	using base::base;
+
+	class pop_awaiter : coro_waiter
+	{
+	public:
+		explicit pop_awaiter(mpmc_async_queue& q)
+			: m_queue(q)
+		{
+			m_try = &attempt;
+		}
+
+		bool await_ready()
+		{
+			return attempt(this);
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			m_handle = h;
+			m_exec = mpmc_executor::current();
+			assert(m_exec);
+
+			return coro_wait::suspend(m_queue.not_empty_channel(), this);
+		}
+
+		T await_resume()
+		{
+			return std::move(*m_value);
+		}
+
+	private:
+		static bool attempt(coro_waiter* w)
+		{
+			auto* a = static_cast<pop_awaiter*>(w);
+			a->m_value = a->m_queue.pop();
+			return a->m_value.has_value();
+		}
+
+		mpmc_async_queue&	m_queue;
+		std::optional<T>	m_value;
+	};
+
+	class push_awaiter : coro_waiter
+	{
+	public:
+		push_awaiter(mpmc_async_queue& q, T&& data)
+			: m_queue(q)
+			, m_value(std::move(data))
+		{
+			m_try = &attempt;
+		}
+
+		bool await_ready()
+		{
+			return attempt(this);
+		}
+
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			m_handle = h;
+			m_exec = mpmc_executor::current();
+			assert(m_exec);
+
+			return coro_wait::suspend(m_queue.not_full_channel(), this);
+		}
+
+		void await_resume() {}
+
+	private:
+		// push(T&&) only moves from m_value once a cell has been claimed
+		static bool attempt(coro_waiter* w)
+		{
+			auto* a = static_cast<push_awaiter*>(w);
+			return a->m_queue.push(std::move(a->m_value));
+		}
+
+		mpmc_async_queue&	m_queue;
+		T					m_value;
+	};
+
+	pop_awaiter async_pop()
+	{
+		return pop_awaiter(*this);
+	}
+
+	push_awaiter async_push(T data)
+	{
+		return push_awaiter(*this, std::move(data));
+	}
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+#include "mpmc_q.h"
+#include "mpmc_thread.h"
+
+// mpmc_queue behind credit based flow control. The queue starts with one
+// credit per cell in m_credits. A producer takes credits in batches into a
+// per thread count and spends one per push; a consumer hands one back per
+// pop, also batched. A producer without credit fails (push) or backs off
+// (push_wait) reading only m_credits, so producers that outpace the
+// consumers stay off the ring's positions and cells instead of retrying
+// claims against a full ring.
+//
+// A credit stands for a cell consumers have released, so a push holding
+// one only finds the ring full for the moment it takes a consumer that is
+// behind the others to release its cell. Credits held in a thread's count
+// are unavailable to others: call return_credits() from a thread that
+// stops pushing or popping for good.
+template<typename T, typename... Options>
+class mpmc_credit_queue
+{
+	using queue_t = mpmc_queue<T, Options...>;
+
+public:
+	enum Limits : uint32_t { MaxPauses = 1024 };
+
+	// batch is how many credits a thread takes or returns at once
+	mpmc_credit_queue(uint64_t q_elements, uint32_t batch = 32)
+		: m_queue(q_elements)
+		, m_batch(std::max<uint32_t>(batch, 1))
+		, m_credits(q_elements)
+	{}
+
+	uint64_t capacity() const { return m_queue.capacity(); }
+
+	// Credits nobody has taken, an estimate of the free cells
+	uint64_t credits() const { return m_credits.load(std::memory_order_relaxed); }
+
+	// Fails without touching the ring when no credit is left
+	bool push(const T& data)
+	{
+		local& l = m_local[mpmc_detail::thread_index()];
+
+		if (l.m_credits == 0 && !acquire(l))
+			return false;
+
+		--l.m_credits;
+
+		while (!m_queue.push(data))
+			__builtin_ia32_pause();
+
+		return true;
+	}
+
+	// Waits for a credit, doubling the pauses between looks at m_credits
+	// up to MaxPauses
+	void push_wait(const T& data)
+	{
+		for (uint32_t pauses = 1; !push(data); pauses = (pauses < MaxPauses) ? pauses * 2 : pauses)
+		{
+			for (uint32_t i = 0; i < pauses; ++i)
+				__builtin_ia32_pause();
+		}
+	}
+
+	bool pop(T& data)
+	{
+		local& l = m_local[mpmc_detail::thread_index()];
+
+		if (!m_queue.pop(data))
+		{
+			// idle, give back what we hold so producers can go on
+			flush(l);
+			return false;
+		}
+
+		if (++l.m_returns == m_batch)
+			flush(l);
+
+		return true;
+	}
+
+	// Gives back the calling thread's unspent credits and pending returns
+	void return_credits()
+	{
+		local& l = m_local[mpmc_detail::thread_index()];
+
+		l.m_returns += l.m_credits;
+		l.m_credits = 0;
+		flush(l);
+	}
+
+	queue_t& queue() { return m_queue; }
+
+private:
+	struct alignas(64) local
+	{
+		uint64_t m_credits{0};	// taken, not yet spent by pushes
+		uint64_t m_returns{0};	// earned by pops, not yet handed back
+	};
+
+	bool acquire(local& l)
+	{
+		uint64_t avail = m_credits.load(std::memory_order_relaxed);
+
+		for(;;)
+		{
+			if (avail == 0)
+				return false;
+
+			uint64_t take = std::min<uint64_t>(avail, m_batch);
+
+			// on failure avail is refreshed with the current count
+			if (m_credits.compare_exchange_weak(avail, avail - take, std::memory_order_acquire))
+			{
+				l.m_credits = take;
+				return true;
+			}
+		}
+	}
+
+	void flush(local& l)
+	{
+		if (l.m_returns == 0)
+			return;
+
+		m_credits.fetch_add(l.m_returns, std::memory_order_release);
+		l.m_returns = 0;
+	}
+
+	queue_t								m_queue;
+	const uint32_t						m_batch;
+	alignas(64) std::atomic<uint64_t>	m_credits;
+
+	local								m_local[mpmc_detail::MaxThreads];
+
+	mpmc_credit_queue(const mpmc_credit_queue&) = delete;
+	void operator = (const mpmc_credit_queue&) = delete;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <type_traits>
+
+#include "mpmc_alloc.h"
+
+// MPMC ring for feeds where a stale message is worth less than a stalled
+// producer, e.g. market data ticks. push() never waits for consumers: once
+// the ring is full it overwrites the oldest unread message. Consumers that
+// find their next position overwritten skip forward to the oldest message
+// still in the ring, and every message skipped that way is counted in
+// dropped().
+//
+// Producers claim positions with a fetch_add and write each cell as a
+// seqlock: 2*pos+1 while writing position pos, 2*pos+2 once published.
+// Consumers copy the payload, re-check the sequence and only then claim
+// the position with a CAS on m_deq, so T must be trivially copyable as a
+// copy may race a writer a lap ahead.
+template<typename T>
+class mpmc_lossy_queue
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "readers copy racing the writers, T must be trivially copyable");
+
+public:
+	explicit mpmc_lossy_queue(uint64_t q_elements)
+		: m_mask(q_elements - 1)
+		, m_cells(new Cell_t[q_elements])
+	{
+		assert(mpmc_detail::is_pow2(q_elements));
+	}
+
+	uint64_t capacity() const { return m_mask + 1; }
+
+	// Never fails and never waits on consumers. It only spins while a
+	// producer a lap behind is still writing the same cell, and drops its
+	// own message if one a lap ahead already took the cell.
+	void push(const T& data)
+	{
+		uint64_t pos = m_enq.fetch_add(1, std::memory_order_relaxed);
+		Cell_t& cell = m_cells[pos & m_mask];
+		uint64_t seq = cell.m_seq.load(std::memory_order_relaxed);
+
+		for(;;)
+		{
+			// stalled for a lap, the message is already stale. Consumers
+			// count it when they skip the position.
+			if (seq > 2 * pos)
+				return;
+
+			if (seq & 1)
+			{
+				__builtin_ia32_pause();
+				seq = cell.m_seq.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			// on failure seq is refreshed with the cell's current sequence
+			if (cell.m_seq.compare_exchange_weak(seq, 2 * pos + 1, std::memory_order_relaxed))
+				break;
+		}
+
+		// consumers still reading the previous lap see the cell change under them
+		std::atomic_thread_fence(std::memory_order_release);
+
+		cell.m_data = data;
+		cell.m_seq.store(2 * pos + 2, std::memory_order_release);
+	}
+
+	// Copies the oldest message still in the ring into data, false when
+	// there is nothing new (or the next one is still being written).
+	bool pop(T& data)
+	{
+		uint64_t pos = m_deq.load(std::memory_order_relaxed);
+
+		for(;;)
+		{
+			Cell_t& cell = m_cells[pos & m_mask];
+			uint64_t seq = cell.m_seq.load(std::memory_order_acquire);
+
+			if (seq < 2 * pos + 2)
+			{
+				// not written yet or being written, unless pos is stale and
+				// other consumers moved past it
+				uint64_t now = m_deq.load(std::memory_order_relaxed);
+
+				if (now == pos)
+					return false;
+
+				pos = now;
+				continue;
+			}
+
+			if (seq == 2 * pos + 2)
+			{
+				data = cell.m_data;
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (cell.m_seq.load(std::memory_order_relaxed) == seq)
+				{
+					// on failure pos is refreshed with the current m_deq
+					if (m_deq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						return true;
+
+					continue;
+				}
+			}
+
+			// overrun, skip to the oldest message still in the ring
+			pos = skip(pos);
+		}
+	}
+
+	// Positions consumers skipped because they were overwritten (or their
+	// producer gave up on them) before anyone read them
+	uint64_t dropped() const
+	{
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	// Moves m_deq from pos past everything that was overwritten, returns
+	// the position to read next
+	uint64_t skip(uint64_t pos)
+	{
+		uint64_t enq = m_enq.load(std::memory_order_relaxed);
+		uint64_t oldest = (enq > capacity()) ? enq - capacity() : 0;
+
+		if (oldest <= pos)
+			oldest = pos + 1; // a writer is mid lap on our cell, drop just it
+
+		if (m_deq.compare_exchange_strong(pos, oldest, std::memory_order_relaxed))
+		{
+			m_dropped.fetch_add(oldest - pos, std::memory_order_relaxed);
+			return oldest;
+		}
+
+		return pos; // another consumer moved it, pos holds the current m_deq
+	}
+
+	struct alignas(alignof(T)) Cell_t
+	{
+		std::atomic<uint64_t>	m_seq{0};
+		T						m_data{};
+	};
+
+	const uint64_t				m_mask;
+	std::unique_ptr<Cell_t[]>	m_cells;
+
+	alignas(64) std::atomic<uint64_t>	m_enq{0};
+	alignas(64) std::atomic<uint64_t>	m_deq{0};
+	alignas(64) std::atomic<uint64_t>	m_dropped{0};
+
+	mpmc_lossy_queue(const mpmc_lossy_queue&) = delete;
+	void operator = (const mpmc_lossy_queue&) = delete;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpmc_q.h"
+#include "mpmc_thread.h"
+#include "shm_region.h"
+
+// mpmc_queue in a memory mapped file, so what is in the ring survives the
+// processes using it. The positions and every cell's sequence live in the
+// file, as laid out by the shared region constructors. Reopening the file
+// runs mpmc_queue::recover(), which keeps what was published and not
+// released and drops what was claimed and never published. It works in
+// place, so a reopen that is killed part way is finished by the next one.
+//
+// Stores into a shared file mapping reach the page cache straight away, so
+// a process that is killed loses nothing it published. Surviving a machine
+// crash takes msync(): with flush_every set, each thread flushes the
+// mapping after every flush_every of its pushes, and flush() can be called
+// at any point.
+//
+// Only one process should open the file at a time, recovery assumes
+// nobody else is using the ring.
+template<typename T, typename... Options>
+class mpmc_persistent_queue
+{
+	using queue_t = mpmc_queue<T, Options...>;
+
+	static bool exists(const std::string& path)
+	{
+		struct stat st;
+		return ::stat(path.c_str(), &st) == 0 && st.st_size != 0;
+	}
+
+public:
+	// Opens the queue in the file at path, or creates it for q_elements.
+	// q_elements is ignored for an existing file, which keeps the capacity
+	// it was created with. Throws std::runtime_error when the file holds a
+	// queue of another layout (or none, e.g. creation was cut short).
+	mpmc_persistent_queue(const std::string& path, uint64_t q_elements, uint64_t flush_every = 0)
+		: m_fresh(!exists(path))
+		, m_region(m_fresh
+				? shm_region::create(shm_region::Backing::File, path, queue_t::GetSize(q_elements))
+				: shm_region::open(shm_region::Backing::File, path))
+		, m_flush_every(flush_every)
+	{
+		if (m_fresh)
+			m_queue = std::make_unique<queue_t>(q_elements, m_region.addr());
+		else
+		{
+			m_queue = std::make_unique<queue_t>(m_region.addr(), m_region.size());
+			m_recovered = m_queue->recover();
+		}
+
+		flush();
+	}
+
+	bool push(const T& data)
+	{
+		if (!m_queue->push(data))
+			return false;
+
+		if (m_flush_every != 0)
+		{
+			uint64_t& pending = m_pending[mpmc_detail::thread_index()].m_count;
+
+			if (++pending == m_flush_every)
+			{
+				pending = 0;
+				flush();
+			}
+		}
+
+		return true;
+	}
+
+	bool pop(T& data)
+	{
+		return m_queue->pop(data);
+	}
+
+	// Writes the whole mapping back to the file and waits for it
+	void flush()
+	{
+		if (::msync(m_region.addr(), m_region.size(), MS_SYNC) != 0)
+			throw std::system_error(errno, std::system_category(), "mpmc_persistent_queue: msync");
+	}
+
+	// Elements found in the file and replayed when it was opened
+	uint64_t recovered() const { return m_recovered; }
+
+	queue_t& queue() { return *m_queue; }
+
+private:
+	struct alignas(64) pending_t
+	{
+		uint64_t m_count{0};
+	};
+
+	bool						m_fresh;	// the file was created here
+	shm_region					m_region;
+	std::unique_ptr<queue_t>	m_queue;
+	uint64_t					m_flush_every;
+	uint64_t					m_recovered{0};
+
+	// pushes since the thread last flushed
+	pending_t					m_pending[mpmc_detail::MaxThreads];
+
+	mpmc_persistent_queue(const mpmc_persistent_queue&) = delete;
+	void operator = (const mpmc_persistent_queue&) = delete;
+};
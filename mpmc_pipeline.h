@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+
+#include "mpmc_alloc.h"
+
+// A chain of processing stages over one ring, disruptor style. A single
+// producer fills slots, stage 0 works on a slot once the producer has
+// published it, stage k once stage k-1 is done with it, and the producer
+// reuses a slot once the last stage is done with it. Slots stay in place
+// and are handed on by position, so the payload is never copied between
+// stages and each stage may modify it for the next.
+//
+// Every stage owns a cursor (the next position it will process) on its own
+// line. The cursor of the stage before it is its sequence barrier: a stage
+// reads the barrier once, processes every slot up to it and publishes its
+// own cursor once, so a stage that fell behind catches up in a batch.
+//
+// Each stage is run by one thread at a time.
+template<typename T>
+class mpmc_pipeline
+{
+public:
+	mpmc_pipeline(uint64_t q_elements, uint32_t stages)
+		: m_mask(q_elements - 1)
+		, m_stages(stages)
+		, m_slots(new T[q_elements])
+		, m_cursors(new cursor[stages + 1])
+	{
+		assert(mpmc_detail::is_pow2(q_elements));
+		assert(stages >= 1);
+	}
+
+	uint64_t capacity() const { return m_mask + 1; }
+	uint32_t stages() const { return m_stages; }
+
+	// Producer side: the next free slot, nullptr while the last stage still
+	// holds it. Fill it in, then publish().
+	T* claim()
+	{
+		uint64_t pos = m_claim;
+
+		if (pos - m_gate > m_mask)
+		{
+			m_gate = m_cursors[m_stages].m_pos.load(std::memory_order_acquire);
+
+			if (pos - m_gate > m_mask)
+				return nullptr;
+		}
+
+		return &m_slots[pos & m_mask];
+	}
+
+	// Hands the slot returned by claim() to stage 0
+	void publish()
+	{
+		m_cursors[0].m_pos.store(++m_claim, std::memory_order_release);
+	}
+
+	bool push(const T& data)
+	{
+		T* slot = claim();
+
+		if (!slot)
+			return false;
+
+		*slot = data;
+		publish();
+		return true;
+	}
+
+	// Runs f(T&, pos) on every slot stage may process now, at most max of
+	// them, in order. Returns the number processed, 0 when the stage before
+	// has nothing new.
+	template <typename F>
+	uint64_t process(uint32_t stage, F&& f, uint64_t max = ~uint64_t{0})
+	{
+		std::atomic<uint64_t>& mine = m_cursors[stage + 1].m_pos;
+
+		uint64_t pos = mine.load(std::memory_order_relaxed);
+		uint64_t barrier = m_cursors[stage].m_pos.load(std::memory_order_acquire);
+		uint64_t count = std::min(barrier - pos, max);
+
+		for (uint64_t i = 0; i != count; ++i)
+			f(m_slots[(pos + i) & m_mask], pos + i);
+
+		if (count)
+			mine.store(pos + count, std::memory_order_release);
+
+		return count;
+	}
+
+	// Next position stage will process, stages() - 1 is the last stage
+	uint64_t position(uint32_t stage) const
+	{
+		return m_cursors[stage + 1].m_pos.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct alignas(64) cursor
+	{
+		std::atomic<uint64_t>	m_pos{0};
+	};
+
+	const uint64_t				m_mask;
+	const uint32_t				m_stages;
+	std::unique_ptr<T[]>		m_slots;
+
+	// [0] the producer's published position, [k + 1] stage k's
+	std::unique_ptr<cursor[]>	m_cursors;
+
+	// producer only
+	alignas(64) uint64_t		m_claim{0};
+	uint64_t					m_gate{0}; // last stage's cursor when last read
+
+	mpmc_pipeline(const mpmc_pipeline&) = delete;
+	void operator = (const mpmc_pipeline&) = delete;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+
+#include "mpmc_q.h"
+#include "mpmc_thread.h"
+
+// K mpmc_queue lanes plus an atomic bitmap of lanes that may be non-empty.
+// Lane 0 is the most urgent. A consumer finds the highest priority
+// non-empty lane with one load of the bitmap and one bit scan, instead of
+// polling every lane.
+//
+// Starvation: after StarvationLimit consecutive pops a consumer served from
+// the highest priority non-empty lane, its next pop is taken from one of
+// the other non-empty lanes. Each consumer rotates those picks over the
+// lanes, so every busy lane below the top one keeps draining under a
+// steady stream of urgent messages, not only the lowest.
+template<typename T, uint32_t Lanes = 4, typename Lane = mpmc_queue<T>>
+class mpmc_priority_queue
+{
+	static_assert(Lanes >= 1 && Lanes <= 64, "one bitmap word of lanes");
+
+public:
+	enum Limits : uint32_t { StarvationLimit = 64 };
+
+	mpmc_priority_queue(uint64_t lane_elements)
+	{
+		for (uint32_t i = 0; i != Lanes; ++i)
+			m_lanes[i] = std::make_unique<Lane>(lane_elements);
+	}
+
+	bool push(const T& data, uint32_t prio)
+	{
+		assert(prio < Lanes);
+
+		if (!m_lanes[prio]->push(data))
+			return false;
+
+		mark(prio);
+		return true;
+	}
+
+	bool push(T&& data, uint32_t prio)
+	{
+		assert(prio < Lanes);
+
+		if (!m_lanes[prio]->push(std::move(data)))
+			return false;
+
+		mark(prio);
+		return true;
+	}
+
+	// prio, when given, receives the lane the element came from
+	bool pop(T& data, uint32_t* prio = nullptr)
+	{
+		served_t& st = m_served[mpmc_detail::thread_index()];
+		uint32_t& served = st.m_count;
+
+		for(;;)
+		{
+			uint64_t bits = m_bitmap.load(std::memory_order_acquire);
+
+			if (bits == 0)
+				return false;
+
+			uint32_t highest = __builtin_ctzll(bits);
+			uint64_t below = bits & (bits - 1); // non-empty lanes but the highest
+			uint32_t lane = highest;
+
+			if (below && served >= StarvationLimit)
+			{
+				// the next non-empty lane after the last one picked, wrapping
+				uint64_t after = below & ~((uint64_t{2} << st.m_last) - 1);
+				lane = __builtin_ctzll(after ? after : below);
+			}
+
+			if (take(lane, data))
+			{
+				if (lane != highest)
+				{
+					served = 0;
+					st.m_last = lane;
+				}
+				else
+					++served;
+
+				if (prio)
+					*prio = lane;
+				return true;
+			}
+		}
+	}
+
+	Lane& lane(uint32_t prio)
+	{
+		assert(prio < Lanes);
+		return *m_lanes[prio];
+	}
+
+private:
+	void mark(uint32_t prio)
+	{
+		uint64_t bit = uint64_t{1} << prio;
+
+		// pairs with the clear in take(): either we see the bit cleared and
+		// set it again, or the consumer's re-check sees our element
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (!(m_bitmap.load(std::memory_order_relaxed) & bit))
+			m_bitmap.fetch_or(bit, std::memory_order_release);
+	}
+
+	// Pops from lane, clearing its bit when it turns out to be empty. The
+	// lane is checked again after the clear so a concurrent push that saw
+	// the bit still set is not stranded.
+	bool take(uint32_t lane, T& data)
+	{
+		if (m_lanes[lane]->pop(data))
+			return true;
+
+		uint64_t bit = uint64_t{1} << lane;
+		m_bitmap.fetch_and(~bit, std::memory_order_seq_cst);
+
+		if (!m_lanes[lane]->pop(data))
+			return false;
+
+		m_bitmap.fetch_or(bit, std::memory_order_release);
+		return true;
+	}
+
+	// Per consumer: pops from the highest lane in a row, and the lane the
+	// last starvation pick went to
+	struct alignas(64) served_t
+	{
+		uint32_t m_count{0};
+		uint32_t m_last{0};
+	};
+
+	alignas(64) std::atomic<uint64_t>	m_bitmap{0};
+	std::unique_ptr<Lane>				m_lanes[Lanes];
+	served_t							m_served[mpmc_detail::MaxThreads];
+
+	mpmc_priority_queue(const mpmc_priority_queue&) = delete;
+	void operator = (const mpmc_priority_queue&) = delete;
+};
@@ -1,106 +1,1108 @@
+#pragma once
+
+#include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <iostream>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-template<typename T>
-class mpmc_queue
+#include "mpmc_alloc.h"
+#include "mpmc_stats.h"
+#include "mpmc_wait.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Compile time options, passed in any order after T in the style of
+// boost::lockfree's policies, e.g. mpmc_queue<T, single_producer>.
+// Each option names its category with option_tag, options that are not
+// given fall back to the default of their category.
+///////////////////////////////////////////////////////////////////////////////
+namespace mpmc_opt
 {
 
-inline bool is_pow2(uint64_t s)
+template <typename Tag, typename Default, typename... Options>
+struct find
 {
-	return ((s >= 2) && !(s & (s - 1)));
-}
+	using type = Default;
+};
+
+template <typename Tag, typename Default, typename Option, typename... Options>
+struct find<Tag, Default, Option, Options...>
+{
+	using type = std::conditional_t<
+			  std::is_same<typename Option::option_tag, Tag>::value
+			, Option
+			, typename find<Tag, Default, Options...>::type>;
+};
+
+struct producer_tag {};
+struct consumer_tag {};
+struct index_tag {};
+struct capacity_tag {};
+
+} // mpmc_opt
+
+// Producer/consumer cardinality. The single side owns its position, so it
+// keeps it in a local cache line and publishes it with a plain store
+// instead of a compare_exchange on the shared control block.
+struct multi_producer	{ using option_tag = mpmc_opt::producer_tag; static constexpr bool single = false; };
+struct single_producer	{ using option_tag = mpmc_opt::producer_tag; static constexpr bool single = true; };
+struct multi_consumer	{ using option_tag = mpmc_opt::consumer_tag; static constexpr bool single = false; };
+struct single_consumer	{ using option_tag = mpmc_opt::consumer_tag; static constexpr bool single = true; };
+
+// Position to cell mapping. linear_index puts consecutive positions in
+// consecutive cells. swizzled_index multiplies the position by an odd
+// stride (a bijection modulo the power of 2 capacity) that spaces cells a
+// cache line plus one cell apart, so positions i and i+1 land on different
+// cache lines even when a cell straddles two, while the cells stay packed:
+// the contention behaviour of padding each cell to a line at the memory
+// footprint of unpadded cells.
+struct linear_index
+{
+	using option_tag = mpmc_opt::index_tag;
+
+	template <uint64_t CellSize>
+	static constexpr uint64_t stride = 1;
+};
+
+struct swizzled_index
+{
+	using option_tag = mpmc_opt::index_tag;
+
+	template <uint64_t CellSize>
+	static constexpr uint64_t stride = ((64 + 2 * CellSize - 2) / CellSize) | 1;
+
+	// True when no two consecutive positions of a ring of cells (a power of
+	// 2) share a cache line, wherever the ring starts within a line
+	template <uint64_t CellSize>
+	static constexpr bool separates(uint64_t cells)
+	{
+		for (uint64_t base = 0; base < 64; base += 8)
+		{
+			for (uint64_t pos = 0; pos != cells; ++pos)
+			{
+				uint64_t a = base + ((pos * stride<CellSize>) & (cells - 1)) * CellSize;
+				uint64_t b = base + (((pos + 1) * stride<CellSize>) & (cells - 1)) * CellSize;
+				uint64_t lo = (a < b) ? a : b;
+				uint64_t hi = (a < b) ? b : a;
+
+				if ((lo + CellSize - 1) / 64 >= hi / 64)
+					return false;
+			}
+		}
+
+		return true;
+	}
+};
+
+static_assert(swizzled_index::separates<8>(1024) && swizzled_index::separates<16>(1024)
+			  && swizzled_index::separates<24>(1024) && swizzled_index::separates<40>(1024)
+			  && swizzled_index::separates<64>(1024) && swizzled_index::separates<72>(1024),
+			  "swizzled_index keeps consecutive positions on different lines");
+
+// Capacity fixed at compile time, e.g. mpmc_queue<T, capacity<1024>>. The
+// mask becomes a constant, the ring lives inside the queue object (so the
+// cells are at a fixed offset from this instead of behind a pointer) and a
+// capacity that is not a power of 2 fails to compile. Without the option
+// the capacity is a constructor argument.
+template <uint64_t N>
+struct capacity
+{
+	using option_tag = mpmc_opt::capacity_tag;
+	static constexpr uint64_t value = N;
+};
+
+using dynamic_capacity = capacity<0>;
+
+template<typename T, typename... Options>
+class mpmc_queue
+{
+using producer_policy = typename mpmc_opt::find<mpmc_opt::producer_tag, multi_producer, Options...>::type;
+using consumer_policy = typename mpmc_opt::find<mpmc_opt::consumer_tag, multi_consumer, Options...>::type;
+using wait_policy = typename mpmc_opt::find<mpmc_opt::wait_tag, busy_spin_wait, Options...>::type;
+using wait_channel = typename wait_policy::channel;
+using index_policy = typename mpmc_opt::find<mpmc_opt::index_tag, linear_index, Options...>::type;
+using capacity_policy = typename mpmc_opt::find<mpmc_opt::capacity_tag, dynamic_capacity, Options...>::type;
+using stats_policy = typename mpmc_opt::find<mpmc_opt::stats_tag, no_stats, Options...>::type;
+
+struct Cell_t;
+
+// 0 when the capacity is given at run time
+static constexpr uint64_t Capacity = capacity_policy::value;
+
+static_assert(Capacity == 0 || mpmc_detail::is_pow2(Capacity), "capacity must be a power of 2");
+
+// shm_header::m_cardinality
+static constexpr uint32_t Cardinality = (producer_policy::single ? 1 : 0) | (consumer_policy::single ? 2 : 0);
 
 public:
-/*
-  void init_shm(uint64_t q_elements, void* buffer)
+struct queue;
+
+// Layout of a queue built inside a caller supplied (usually shared) buffer:
+//   shm_header | queue | Cell_t[capacity]
+// The header lets a second process check it was compiled with the same
+// element type, layout, cardinality and wait strategy before it attaches.
+struct shm_header
 {
-	m_q_mem = reinterpret_cast<Cell_t*>(buffer);
-	m_q_pos_mask_ = q_elements - 1;
-	assert((q_elements >= 2) && ((q_elements & (q_elements - 1)) == 0));
+	std::atomic<uint64_t>	m_magic{0}; // written last, marks the ring ready
+	uint32_t				m_version{0};
+	uint32_t				m_elem_size{0};
+	uint64_t				m_capacity{0};
+	uint64_t				m_cell_size{0};
+	uint64_t				m_queue_size{0}; // control block, differs per wait strategy
+	uint64_t				m_index_stride{0};
+	uint32_t				m_cardinality{0}; // bit 0 single producer, bit 1 single consumer
+	uint32_t				m_wait{0}; // wait_policy::id
+};
 
-	shm = true;
+static constexpr uint64_t ShmMagic = 0x4d504d4351554555; // "MPMCQUEU"
+static constexpr uint32_t ShmVersion = 6;
 
-	for (uint64_t i = 0; i != q_elements; i += 1)
-		m_q_mem[i].m_seq.store(i, std::memory_order_relaxed);
+// Bytes per cell: the payload, its sequence and alignment padding
+static constexpr uint64_t cell_size() { return sizeof(Cell_t); }
 
-	m_enq_pos.store(0, std::memory_order_relaxed);
-	m_deq_pos.store(0, std::memory_order_relaxed);
-}
-*/
 static uint64_t GetSize ( uint64_t elements )
 {
 	uint64_t cell_size = sizeof(Cell_t) * elements;
-	uint64_t q_struct_size = sizeof(queue);
 
-	return cell_size + q_struct_size;
+	return cells_offset() + cell_size;
 }
 
+// Builds a new queue inside buffer, which must hold GetSize(q_elements)
+// bytes and be aligned to alignof(Cell_t). Typically a mapping another
+// process attaches to with mpmc_queue(void*, uint64_t).
+mpmc_queue(uint64_t q_elements, void* buffer)
+	: m_q_pos_mask_(q_elements - 1)
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "only trivially copyable types can be shared between processes");
+	static_assert(Capacity == 0, "a capacity<N> queue holds its ring inline");
+	static_assert(wait_policy::shareable, "this wait strategy only works in process");
+
+	init_shm(q_elements, buffer);
+}
+
+// Attaches to a queue built by mpmc_queue(uint64_t, void*), possibly in
+// another process. size is the number of bytes mapped at buffer. Throws
+// std::runtime_error when the header does not match this instantiation or
+// the ring it describes does not fit in size.
+mpmc_queue(void* buffer, uint64_t size)
+	: m_q_pos_mask_(validate_shm(buffer, size) - 1)
+{
+	static_assert(Capacity == 0, "a capacity<N> queue holds its ring inline");
+	static_assert(wait_policy::shareable, "this wait strategy only works in process");
+
+	// for the timed calls, see try_push_until
+	tsc_per_ns();
+
+	char* base = static_cast<char*>(buffer);
+
+	m_q = reinterpret_cast<queue*>(base + queue_offset());
+	m_q_mem = reinterpret_cast<Cell_t*>(base + cells_offset());
+
+	m_enq_local = control()->m_enq_pos.load(std::memory_order_acquire);
+	m_deq_local = control()->m_deq_pos.load(std::memory_order_acquire);
+}
 
-mpmc_queue(uint64_t q_elements)
+// In-process queue. Header, control block and cells share one anonymous
+// mapping placed according to alloc (huge pages, NUMA node, init threads).
+mpmc_queue(uint64_t q_elements, const mpmc_alloc& alloc = mpmc_alloc())
 	: m_q_pos_mask_(q_elements - 1)
-	, m_q_mem(new Cell_t [q_elements])
 {
-	assert(is_pow2(q_elements));
+	static_assert(Capacity == 0, "a capacity<N> queue is default constructed");
+	assert(mpmc_detail::is_pow2(q_elements));
 
-	m_q = new queue;
+	m_map_size = GetSize(q_elements);
+	m_map = mpmc_detail::map(m_map_size, alloc);
 
-	for (uint64_t i = 0; i != q_elements; ++i)
-		m_q_mem[i].m_done.store(false, std::memory_order_relaxed);
+	uint32_t threads = alloc.init_threads;
+	if (threads == 0)
+		threads = (q_elements < ParallelInitCells) ? 1 : std::thread::hardware_concurrency();
 
-	m_q->m_enq_pos.store(0, std::memory_order_relaxed);
+	init_shm(q_elements, m_map, threads);
+}
 
-	m_q->m_deq_pos.store(0, std::memory_order_relaxed);
+// Fixed capacity queue, header, control block and cells live inside the
+// object. Large rings should be heap allocated rather than put on a stack.
+mpmc_queue()
+	: m_q_pos_mask_(Capacity - 1)
+{
+	static_assert(Capacity != 0, "the capacity is a constructor argument without the capacity<N> option");
+	static_assert(offsetof(inline_layout, m_cells) == cells_offset(), "inline ring layout");
 
-	std::cout << "Size of Cell_t = " << sizeof(Cell_t) << std::endl;
+	init_shm(Capacity, m_inline.data());
 }
 
 ~mpmc_queue()
 {
-	//delete [] m_q_mem;
+	// the buffer owns shared queues
+	if (!m_map && Capacity == 0)
+		return;
+
+	// payloads still published between the consumer and producer positions
+	if constexpr (!std::is_trivially_destructible<T>::value)
+	{
+		uint64_t enq = control()->m_enq_pos.load(std::memory_order_acquire);
+
+		for (uint64_t pos = control()->m_deq_pos.load(std::memory_order_acquire); pos != enq; ++pos)
+		{
+			Cell_t& cell = *cell_at(pos);
+			if (cell.m_seq.load(std::memory_order_acquire) == pos + 1)
+				cell.destroy();
+		}
+	}
+
+	// the wait channels may own resources, eventfd_wait's fd
+	control()->~queue();
+
+	if (m_map)
+		mpmc_detail::unmap(m_map, m_map_size);
+}
+
+// Constructs the payload in place in the claimed cell. A constructor that
+// throws leaves the position unpublished and stalls the ring.
+template <typename... Args>
+bool emplace(Args&&... args)
+{
+	uint64_t pos;
+	Cell_t* cell = claim_enq(pos);
+
+	if (!cell)
+		return false;
+
+	cell->construct(std::forward<Args>(args)...);
+	cell->m_seq.store(pos + 1, std::memory_order_release);
+	wait_policy::notify(control()->m_not_empty);
+	sample_depth(pos, 1);
+
+	return true;
 }
 
 bool push(const T& data)
 {
-	Cell_t* cell;
+	return emplace(data);
+}
+
+bool push(T&& data)
+{
+	return emplace(std::move(data));
+}
+
+// Moves the payload out and destroys it in the cell, so an empty cell
+// never holds a live T.
+bool pop(T& data)
+{
+	uint64_t pos;
+	Cell_t* cell = claim_deq(pos);
+
+	if (!cell)
+		return false;
+
+	data = std::move(*cell->data());
+	cell->destroy();
+	cell->m_seq.store(pos + mask() + 1, std::memory_order_release);
+	wait_policy::notify(control()->m_not_full);
+
+	return true;
+}
+
+// For payloads that are not default constructible
+std::optional<T> pop()
+{
+	uint64_t pos;
+	Cell_t* cell = claim_deq(pos);
+
+	if (!cell)
+		return std::nullopt;
+
+	std::optional<T> data(std::move(*cell->data()));
+	cell->destroy();
+	cell->m_seq.store(pos + mask() + 1, std::memory_order_release);
+	wait_policy::notify(control()->m_not_full);
+
+	return data;
+}
+
+// Blocking variants, the wait_strategy option (busy_spin_wait by default)
+// decides how the caller waits for a free/published cell. stats, when
+// given, accumulates how often the caller was parked and woken.
+void push_wait(const T& data, wait_stats* stats = nullptr)
+{
+	wait_policy::wait(control()->m_not_full, [&] { return push(data); }, stats);
+}
+
+// data is only moved from once a cell has been claimed
+void push_wait(T&& data, wait_stats* stats = nullptr)
+{
+	wait_policy::wait(control()->m_not_full, [&] { return push(std::move(data)); }, stats);
+}
+
+void pop_wait(T& data, wait_stats* stats = nullptr)
+{
+	wait_policy::wait(control()->m_not_empty, [&] { return pop(data); }, stats);
+}
+
+// The wait strategy's channels, for waiters built outside the queue such
+// as the coroutine awaitables in mpmc_coro.h. Producers notify not_empty,
+// consumers notify not_full.
+wait_channel& not_empty_channel() { return control()->m_not_empty; }
+wait_channel& not_full_channel() { return control()->m_not_full; }
+
+// Timed variants, give up when the TSC (getcc_ns()) reaches deadline, a
+// TSC value, or after ns nanoseconds converted with the calibrated TSC
+// rate. Retries spin, then back off, see mpmc_detail::retry_until. The
+// rate is calibrated (10 ms, once per process) when the first queue is
+// built or attached, so no timed call pays for it.
+bool try_push_until(const T& data, uint64_t deadline)
+{
+	return mpmc_detail::retry_until(deadline, [&] { return push(data); });
+}
+
+// data is only moved from once a cell has been claimed
+bool try_push_until(T&& data, uint64_t deadline)
+{
+	return mpmc_detail::retry_until(deadline, [&] { return push(std::move(data)); });
+}
+
+bool try_push_for(const T& data, uint64_t ns)
+{
+	return try_push_until(data, getcc_ns() + ns_to_tsc(ns));
+}
+
+bool try_push_for(T&& data, uint64_t ns)
+{
+	return try_push_until(std::move(data), getcc_ns() + ns_to_tsc(ns));
+}
+
+bool try_pop_until(T& data, uint64_t deadline)
+{
+	return mpmc_detail::retry_until(deadline, [&] { return pop(data); });
+}
+
+bool try_pop_for(T& data, uint64_t ns)
+{
+	return try_pop_until(data, getcc_ns() + ns_to_tsc(ns));
+}
+
+// A cell claimed by try_claim(). The payload is built in place with
+// emplace(); trivially default constructible payloads are live as soon as
+// the cell is claimed and can be filled in through the handle directly.
+// Claiming a position cannot be undone, so a handle that goes out of
+// scope without commit() publishes the cell itself, default constructing
+// the payload if it was never emplaced.
+class write_slot
+{
+public:
+	write_slot() = default;
+
+	write_slot(write_slot&& s)
+		: m_cell(std::exchange(s.m_cell, nullptr))
+		, m_wake(s.m_wake)
+		, m_pos(s.m_pos)
+		, m_live(s.m_live)
+	{}
+
+	write_slot& operator = (write_slot&& s)
+	{
+		if (&s != this)
+		{
+			commit();
+			m_cell = std::exchange(s.m_cell, nullptr);
+			m_wake = s.m_wake;
+			m_pos = s.m_pos;
+			m_live = s.m_live;
+		}
+		return *this;
+	}
+
+	~write_slot() { commit(); }
+
+	explicit operator bool() const { return m_cell != nullptr; }
+
+	template <typename... Args>
+	T& emplace(Args&&... args)
+	{
+		if (m_live)
+			m_cell->destroy();
+		m_live = false;
+
+		m_cell->construct(std::forward<Args>(args)...);
+		m_live = true;
+
+		return *m_cell->data();
+	}
+
+	T& operator * () const { return *m_cell->data(); }
+	T* operator -> () const { return m_cell->data(); }
+
+	// publishes the payload built through the handle
+	void commit()
+	{
+		if (!m_cell)
+			return;
+
+		if (!m_live)
+		{
+			if constexpr (std::is_default_constructible<T>::value)
+				emplace();
+			else
+				std::terminate(); // nothing to publish and the position is taken
+		}
+
+		m_cell->m_seq.store(m_pos + 1, std::memory_order_release);
+		m_cell = nullptr;
+		wait_policy::notify(*m_wake);
+	}
+
+private:
+	friend class mpmc_queue;
+
+	write_slot(Cell_t* cell, wait_channel* wake, uint64_t pos)
+		: m_cell(cell)
+		, m_wake(wake)
+		, m_pos(pos)
+	{
+		if constexpr (std::is_trivially_default_constructible<T>::value)
+		{
+			m_cell->construct_default();
+			m_live = true;
+		}
+	}
+
+	Cell_t*			m_cell{nullptr};
+	wait_channel*	m_wake{nullptr};
+	uint64_t		m_pos{0};
+	bool			m_live{false};
+};
+
+// A published cell claimed by try_read(). release() (or the destructor)
+// destroys the payload and hands the cell back to the producers.
+class read_slot
+{
+public:
+	read_slot() = default;
+
+	read_slot(read_slot&& s)
+		: m_cell(std::exchange(s.m_cell, nullptr))
+		, m_wake(s.m_wake)
+		, m_free_seq(s.m_free_seq)
+	{}
+
+	read_slot& operator = (read_slot&& s)
+	{
+		if (&s != this)
+		{
+			release();
+			m_cell = std::exchange(s.m_cell, nullptr);
+			m_wake = s.m_wake;
+			m_free_seq = s.m_free_seq;
+		}
+		return *this;
+	}
+
+	~read_slot() { release(); }
+
+	explicit operator bool() const { return m_cell != nullptr; }
+
+	const T& operator * () const { return *m_cell->data(); }
+	const T* operator -> () const { return m_cell->data(); }
+
+	void release()
+	{
+		if (!m_cell)
+			return;
+
+		m_cell->destroy();
+		m_cell->m_seq.store(m_free_seq, std::memory_order_release);
+		m_cell = nullptr;
+		wait_policy::notify(*m_wake);
+	}
+
+private:
+	friend class mpmc_queue;
+
+	read_slot(Cell_t* cell, wait_channel* wake, uint64_t free_seq)
+		: m_cell(cell)
+		, m_wake(wake)
+		, m_free_seq(free_seq)
+	{}
+
+	Cell_t*			m_cell{nullptr};
+	wait_channel*	m_wake{nullptr};
+	uint64_t		m_free_seq{0};
+};
+
+// Zero copy producer side: claims the next free cell and returns a handle
+// to construct the payload in place, empty when the queue is full.
+write_slot try_claim()
+{
+	uint64_t pos;
+	Cell_t* cell = claim_enq(pos);
+
+	if (!cell)
+		return write_slot();
+
+	sample_depth(pos, 1);
+	return write_slot(cell, &control()->m_not_empty, pos);
+}
+
+// Zero copy consumer side: claims the next published cell and returns a
+// const view of it, empty when the queue is empty.
+read_slot try_read()
+{
+	uint64_t pos;
+	Cell_t* cell = claim_deq(pos);
+
+	if (!cell)
+		return read_slot();
+
+	return read_slot(cell, &control()->m_not_full, pos + mask() + 1);
+}
+
+// Claims up to n consecutive free cells with a single CAS on m_enq_pos.
+// Returns the number of elements pushed, 0 when the queue is full.
+uint64_t push_bulk(const T* data, uint64_t n)
+{
+	uint64_t pos;
+	uint64_t count = claim<producer_policy::single>(control()->m_enq_pos, m_enq_local, 0, n, pos);
+
+	for (uint64_t i = 0; i != count; ++i)
+	{
+		Cell_t* cell = cell_at(pos + i);
+		cell->construct(data[i]);
+		cell->m_seq.store(pos + i + 1, std::memory_order_release);
+	}
+
+	if (count)
+	{
+		wait_policy::notify(control()->m_not_empty, count);
+		sample_depth(pos, count);
+	}
+
+	return count;
+}
+
+// Claims up to max consecutive published cells with a single CAS on
+// m_deq_pos. Returns the number of elements popped, 0 when empty.
+uint64_t pop_bulk(T* data, uint64_t max)
+{
+	uint64_t pos;
+	uint64_t count = claim<consumer_policy::single>(control()->m_deq_pos, m_deq_local, 1, max, pos);
+
+	for (uint64_t i = 0; i != count; ++i)
+	{
+		Cell_t* cell = cell_at(pos + i);
+		data[i] = std::move(*cell->data());
+		cell->destroy();
+		cell->m_seq.store(pos + i + mask() + 1, std::memory_order_release);
+	}
+
+	if (count)
+		wait_policy::notify(control()->m_not_full, count);
+
+	return count;
+}
+
+// Drains everything that is published, calling f(T&) on each element in
+// place (f may move it out) before it is destroyed. Every batch costs one
+// CAS on m_deq_pos.
+template <typename F>
+uint64_t consume_all(F&& f)
+{
+	uint64_t total{0};
 
 	for(;;)
 	{
-		uint64_t pos = m_q->m_enq_pos.load(std::memory_order_acquire);
-		cell = &(m_q_mem[pos & m_q_pos_mask_]);
+		uint64_t pos;
+		uint64_t count = claim<consumer_policy::single>(control()->m_deq_pos, m_deq_local, 1, mask() + 1, pos);
+
+		if (count == 0)
+			return total;
+
+		for (uint64_t i = 0; i != count; ++i)
+		{
+			Cell_t* cell = cell_at(pos + i);
+			f(*cell->data());
+			cell->destroy();
+			cell->m_seq.store(pos + i + mask() + 1, std::memory_order_release);
+		}
+
+		wait_policy::notify(control()->m_not_full, count);
+		total += count;
+	}
+}
 
-		if (cell->m_done.load(std::memory_order_relaxed) == true)
-			return false;
+// Occupancy, read from the shared positions without writing anything. The
+// positions move while they are read, so these are snapshots: a depth
+// counts claimed positions, including cells still being written or read.
+uint64_t capacity() const
+{
+	return mask() + 1;
+}
+
+uint64_t size_approx() const
+{
+	// deq first, so a racing pop can only make the depth look smaller
+	uint64_t deq = control()->m_deq_pos.load(std::memory_order_acquire);
+	uint64_t enq = control()->m_enq_pos.load(std::memory_order_acquire);
+
+	return (enq > deq) ? std::min(enq - deq, capacity()) : 0;
+}
 
-		if (!m_q->m_enq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+bool empty() const
+{
+	return size_approx() == 0;
+}
+
+bool full() const
+{
+	return size_approx() == capacity();
+}
+
+// Largest depth a producer saw at one of its samples, taken every
+// DepthSample positions. Not exact: a peak between samples is missed.
+uint64_t high_water_mark() const
+{
+	return control()->m_peak.load(std::memory_order_relaxed);
+}
+
+// Returns the mark and restarts it from the current depth, for per interval peaks
+uint64_t reset_high_water_mark()
+{
+	return control()->m_peak.exchange(size_approx(), std::memory_order_relaxed);
+}
+
+// Contention events counted by this process's threads so far, all zero
+// unless the queue was built with contention_stats.
+mpmc_stats stats() const
+{
+	return stats_policy::collect(m_stats);
+}
+
+// Rebuilds a shared queue left behind by processes that died, e.g. one in
+// a file mapping reopened after a crash. Every element that was published
+// and not released, still queued or taken by a consumer that died before
+// releasing it, is kept in order. Cells that were claimed but never
+// published are dropped. Call before any other thread or process uses the
+// queue. Returns the number of elements kept.
+//
+// Works in place, so a recovery that is itself killed loses nothing and
+// the next recover() finishes it: the survivors are moved up against
+// m_enq_pos one cell at a time, each move journaled in the control block,
+// and m_deq_pos only moves to the first of them once they are all there.
+uint64_t recover()
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "only trivially copyable types survive in a shared region");
+
+	queue* q = control();
+	uint64_t enq = q->m_enq_pos.load(std::memory_order_acquire);
+	uint64_t first = (enq > capacity()) ? enq - capacity() : 0;
+
+	// a move an earlier recovery was killed in is complete once its
+	// destination is published, then only the source has to go
+	if (q->m_moving.load(std::memory_order_acquire))
+	{
+		uint64_t src = q->m_move_src.load(std::memory_order_relaxed);
+		uint64_t dst = q->m_move_dst.load(std::memory_order_relaxed);
+
+		if (cell_at(dst)->m_seq.load(std::memory_order_acquire) == dst + 1)
+			cell_at(src)->m_seq.store(src, std::memory_order_release);
+
+		q->m_moving.store(0, std::memory_order_release);
+	}
+
+	// newest first, so the survivors keep their order. The destination is
+	// never a survivor: it was dropped or already moved from.
+	uint64_t dst = enq;
+
+	for (uint64_t pos = enq; pos-- != first; )
+	{
+		Cell_t* cell = cell_at(pos);
+
+		if (cell->m_seq.load(std::memory_order_acquire) != pos + 1)
 			continue;
 
-		cell->m_data = data;
-		cell->m_done.store(true, std::memory_order_release);
+		if (--dst == pos)
+			continue;
 
-		return true;
+		q->m_move_src.store(pos, std::memory_order_relaxed);
+		q->m_move_dst.store(dst, std::memory_order_relaxed);
+		q->m_moving.store(1, std::memory_order_release);
+
+		Cell_t* to = cell_at(dst);
+		to->construct(*cell->data());
+		to->m_seq.store(dst + 1, std::memory_order_release);
+		cell->m_seq.store(pos, std::memory_order_release); // claimed, never published
+
+		q->m_moving.store(0, std::memory_order_release);
 	}
+
+	// cells below the survivors are free for the producers' next lap
+	for (uint64_t pos = first; pos != dst; ++pos)
+		cell_at(pos)->m_seq.store(pos + mask() + 1, std::memory_order_release);
+
+	q->m_deq_pos.store(dst, std::memory_order_release);
+	q->m_peak.store(0, std::memory_order_relaxed);
+	m_enq_local = enq;
+	m_deq_local = dst;
+
+	return enq - dst;
 }
 
-bool pop(T& data)
+private:
+static constexpr uint64_t align_up(uint64_t v, uint64_t a)
+{
+	return (v + a - 1) & ~(a - 1);
+}
+
+static constexpr uint64_t queue_offset()
+{
+	return align_up(sizeof(shm_header), alignof(queue));
+}
+
+static constexpr uint64_t cells_offset()
+{
+	return align_up(queue_offset() + sizeof(queue), alignof(Cell_t));
+}
+
+// Rings at least this big are constructed by several threads by default
+static constexpr uint64_t ParallelInitCells = 1 << 20;
+
+static constexpr uint64_t IndexStride = index_policy::template stride<sizeof(Cell_t)>;
+
+static_assert(!std::is_same<index_policy, swizzled_index>::value
+			  || swizzled_index::separates<sizeof(Cell_t)>(1024),
+			  "swizzled_index keeps consecutive positions on different lines");
+
+// Positions between two samples of the depth by the producers
+static constexpr uint64_t DepthSample = 64;
+
+// Called after positions [pos, pos + count) were claimed. Only the claim
+// that crosses a multiple of DepthSample reads m_deq_pos, and m_peak is
+// only written when the depth passed it, so the hot path stays read-only.
+void sample_depth(uint64_t pos, uint64_t count)
+{
+	uint64_t end = pos + count;
+
+	if (((pos ^ end) & ~(DepthSample - 1)) == 0)
+		return;
+
+	uint64_t deq = control()->m_deq_pos.load(std::memory_order_relaxed);
+	uint64_t depth = (end > deq) ? std::min(end - deq, capacity()) : 0;
+	uint64_t peak = control()->m_peak.load(std::memory_order_relaxed);
+
+	while (depth > peak && !control()->m_peak.compare_exchange_weak(peak, depth, std::memory_order_relaxed))
+	{}
+}
+
+uint64_t mask() const
+{
+	if constexpr (Capacity != 0)
+		return Capacity - 1;
+	else
+		return m_q_pos_mask_;
+}
+
+// The control block of a capacity<N> queue sits at a fixed offset from
+// this, so positions are reached without loading m_q first
+queue* control()
+{
+	if constexpr (Capacity != 0)
+		return reinterpret_cast<queue*>(m_inline.data() + queue_offset());
+	else
+		return m_q;
+}
+
+const queue* control() const
+{
+	if constexpr (Capacity != 0)
+		return reinterpret_cast<const queue*>(m_inline.data() + queue_offset());
+	else
+		return m_q;
+}
+
+Cell_t* cells()
+{
+	if constexpr (Capacity != 0)
+		return reinterpret_cast<Cell_t*>(m_inline.data() + cells_offset());
+	else
+		return m_q_mem;
+}
+
+Cell_t* cell_at(uint64_t pos)
+{
+	return &cells()[(pos * IndexStride) & mask()];
+}
+
+// Constructs the cells for positions [first, last). This is also the first touch of
+// every page of the ring, so it pre-faults the mapping.
+void init_cells(uint64_t first, uint64_t last)
+{
+	// cell i is free for the producer claiming position i on the first lap
+	for (uint64_t i = first; i != last; ++i)
+	{
+		Cell_t* cell = new (cell_at(i)) Cell_t;
+		cell->m_seq.store(i, std::memory_order_relaxed);
+	}
+}
+
+void init_shm(uint64_t q_elements, void* buffer, uint32_t threads = 1)
+{
+	assert(mpmc_detail::is_pow2(q_elements));
+
+	// for the timed calls, see try_push_until
+	tsc_per_ns();
+
+	char* base = static_cast<char*>(buffer);
+	auto* header = new (base) shm_header;
+
+	m_q = new (base + queue_offset()) queue;
+	m_q_mem = reinterpret_cast<Cell_t*>(base + cells_offset());
+
+	if (threads <= 1)
+		init_cells(0, q_elements);
+	else
+	{
+		std::vector<std::thread> workers;
+		workers.reserve(threads);
+
+		uint64_t chunk = (q_elements + threads - 1) / threads;
+		for (uint64_t first = 0; first < q_elements; first += chunk)
+			workers.emplace_back(&mpmc_queue::init_cells, this, first, std::min(first + chunk, q_elements));
+
+		for (auto& w : workers)
+			w.join();
+	}
+
+	control()->m_enq_pos.store(0, std::memory_order_relaxed);
+	control()->m_deq_pos.store(0, std::memory_order_relaxed);
+	control()->m_peak.store(0, std::memory_order_relaxed);
+	control()->m_moving.store(0, std::memory_order_relaxed);
+
+	header->m_version = ShmVersion;
+	header->m_elem_size = sizeof(T);
+	header->m_capacity = q_elements;
+	header->m_cell_size = sizeof(Cell_t);
+	header->m_queue_size = sizeof(queue);
+	header->m_index_stride = IndexStride;
+	header->m_cardinality = Cardinality;
+	header->m_wait = wait_policy::id;
+	header->m_magic.store(ShmMagic, std::memory_order_release);
+}
+
+static uint64_t validate_shm(void* buffer, uint64_t size)
+{
+	const auto* header = static_cast<const shm_header*>(buffer);
+
+	if (size < cells_offset())
+		throw std::runtime_error("mpmc_queue: shared region too small for a queue");
+
+	if (header->m_magic.load(std::memory_order_acquire) != ShmMagic)
+		throw std::runtime_error("mpmc_queue: no queue found in shared region");
+
+	if (header->m_version != ShmVersion)
+		throw std::runtime_error("mpmc_queue: shared region version mismatch");
+
+	if (header->m_elem_size != sizeof(T) || header->m_cell_size != sizeof(Cell_t)
+		|| header->m_queue_size != sizeof(queue) || header->m_index_stride != IndexStride)
+		throw std::runtime_error("mpmc_queue: shared region element layout mismatch");
+
+	if (header->m_cardinality != Cardinality)
+		throw std::runtime_error("mpmc_queue: shared region producer/consumer cardinality mismatch");
+
+	if (header->m_wait != wait_policy::id)
+		throw std::runtime_error("mpmc_queue: shared region wait strategy mismatch");
+
+	if (!mpmc_detail::is_pow2(header->m_capacity))
+		throw std::runtime_error("mpmc_queue: shared region capacity is not a power of 2");
+
+	// also keeps a corrupt capacity from overflowing GetSize
+	if (header->m_capacity > (size - cells_offset()) / sizeof(Cell_t))
+		throw std::runtime_error("mpmc_queue: shared region smaller than its ring");
+
+	return header->m_capacity;
+}
+
+// Claims the next position for a single element, returning its cell or
+// nullptr when the queue is full. pos is the claimed position.
+Cell_t* claim_enq(uint64_t& pos)
 {
 	Cell_t* cell;
 
+	if constexpr (producer_policy::single)
+	{
+		// nobody else moves m_enq_pos, the cell alone says whether it is free
+		pos = m_enq_local;
+		cell = cell_at(pos);
+
+		if (cell->m_seq.load(std::memory_order_acquire) != pos)
+		{
+			count_miss(0, pos);
+			return nullptr;
+		}
+
+		m_enq_local = pos + 1;
+		control()->m_enq_pos.store(pos + 1, std::memory_order_release);
+
+		return cell;
+	}
+
+	pos = control()->m_enq_pos.load(std::memory_order_relaxed);
+
 	for(;;)
 	{
-		uint64_t pos = m_q->m_deq_pos.load(std::memory_order_acquire);
-		cell = &(m_q_mem[pos & m_q_pos_mask_]);
+		cell = cell_at(pos);
+
+		uint64_t seq = cell->m_seq.load(std::memory_order_acquire);
+		int64_t dif = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+
+		if (dif == 0)
+		{
+			// on failure pos is refreshed with the current m_enq_pos
+			if (control()->m_enq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return cell;
+
+			stats_policy::count(m_stats, mpmc_event::CasFailure);
+		}
+		else if (dif < 0)
+		{
+			count_miss(0, pos); // a consumer has not released this cell yet, full
+			return nullptr;
+		}
+		else
+			pos = control()->m_enq_pos.load(std::memory_order_relaxed); // another producer is ahead
+	}
+}
+
+// Claims the next published position, returning its cell or nullptr when
+// the queue is empty. pos is the claimed position.
+Cell_t* claim_deq(uint64_t& pos)
+{
+	Cell_t* cell;
+
+	if constexpr (consumer_policy::single)
+	{
+		pos = m_deq_local;
+		cell = cell_at(pos);
+
+		if (cell->m_seq.load(std::memory_order_acquire) != pos + 1)
+		{
+			count_miss(1, pos);
+			return nullptr;
+		}
 
-		if (cell->m_done.load(std::memory_order_relaxed) == false)
-			return false;
-	
-		if (!m_q->m_deq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+		m_deq_local = pos + 1;
+		control()->m_deq_pos.store(pos + 1, std::memory_order_release);
+
+		return cell;
+	}
+
+	pos = control()->m_deq_pos.load(std::memory_order_relaxed);
+
+	for(;;)
+	{
+		cell = cell_at(pos);
+
+		uint64_t seq = cell->m_seq.load(std::memory_order_acquire);
+		int64_t dif = static_cast<int64_t>(seq) - static_cast<int64_t>(pos + 1);
+
+		if (dif == 0)
+		{
+			if (control()->m_deq_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				return cell;
+
+			stats_policy::count(m_stats, mpmc_event::CasFailure);
+		}
+		else if (dif < 0)
+		{
+			count_miss(1, pos); // not published yet, empty
+			return nullptr;
+		}
+		else
+			pos = control()->m_deq_pos.load(std::memory_order_relaxed); // another consumer is ahead
+	}
+}
+
+// Shared by the bulk operations. ready is 0 for producers (cell free for
+// pos) and 1 for consumers (cell published for pos). Counts how many cells
+// from the current position are ready, up to n, and claims them all at
+// once. The first position claimed is returned in pos. A Single side
+// works from its local copy and publishes it with a plain store.
+template <bool Single>
+uint64_t claim(std::atomic<uint64_t>& shared_pos, uint64_t& local_pos, uint64_t ready, uint64_t n, uint64_t& pos)
+{
+	pos = Single ? local_pos : shared_pos.load(std::memory_order_relaxed);
+
+	if (n == 0)
+		return 0;
+
+	for(;;)
+	{
+		uint64_t count{0};
+		int64_t dif{0};
+
+		for (; count != n; ++count)
+		{
+			const Cell_t* cell = cell_at(pos + count);
+			uint64_t seq = cell->m_seq.load(std::memory_order_acquire);
+			dif = static_cast<int64_t>(seq) - static_cast<int64_t>(pos + count + ready);
+
+			if (dif != 0)
+				break;
+		}
+
+		if constexpr (Single)
+		{
+			if (count != 0)
+			{
+				local_pos = pos + count;
+				shared_pos.store(local_pos, std::memory_order_release);
+			}
+			else
+				count_miss(ready, pos);
+
+			return count;
+		}
+
+		if (count == 0)
+		{
+			if (dif < 0)
+			{
+				count_miss(ready, pos);
+				return 0;
+			}
+
+			pos = shared_pos.load(std::memory_order_relaxed);
 			continue;
+		}
 
-		data = cell->m_data;
-		cell->m_done.store(false, std::memory_order_release);
+		if (shared_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+			return count;
 
-		return true;
+		stats_policy::count(m_stats, mpmc_event::CasFailure);
+	}
+}
+
+// Counts a claim that found no ready cell at pos. ready is 0 for a
+// producer, which found the queue full. A consumer tells an empty queue
+// from a cell whose producer claimed it but has not published it yet.
+void count_miss(uint64_t ready, uint64_t pos)
+{
+	if constexpr (stats_policy::enabled)
+	{
+		if (ready == 0)
+			stats_policy::count(m_stats, mpmc_event::Full);
+		else if (control()->m_enq_pos.load(std::memory_order_relaxed) > pos)
+			stats_policy::count(m_stats, mpmc_event::Unpublished);
+		else
+			stats_policy::count(m_stats, mpmc_event::Empty);
 	}
 }
 
@@ -111,19 +1113,85 @@ public:
 		alignas(alignof(T)) char x1; // shadow false sharing
 		alignas(alignof(T)) std::atomic<uint64_t>   m_deq_pos;
 		alignas(alignof(T)) char x2; // shadow false sharing?
+
+		wait_channel	m_not_empty; // consumers park here, producers notify
+		wait_channel	m_not_full;  // producers park here, consumers notify
+
+		alignas(64) std::atomic<uint64_t>	m_peak; // sampled high-water mark
+
+		// recover()'s journal, the cell it is moving while m_moving is set
+		alignas(64) std::atomic<uint64_t>	m_moving;
+		std::atomic<uint64_t>				m_move_src;
+		std::atomic<uint64_t>				m_move_dst;
 	};
 
 private:
+	// Each cell carries the position it is ready for:
+	//   m_seq == pos              free, the producer claiming pos may write it
+	//   m_seq == pos + 1          published, the consumer claiming pos may read it
+	//   m_seq == pos + mask + 1   released, free for the producer one lap later
+	// Comparing m_seq against the position tells "mine", "full/empty" and
+	// "another thread is ahead" apart before the shared counter is touched.
+	// The payload storage is raw, a T is alive only between construct()
+	// by the producer and destroy() by the consumer.
 	struct alignas(alignof(T)) Cell_t
 	{
-		std::atomic<bool>		m_done{false};
-		T						m_data;
+		std::atomic<uint64_t>	m_seq{0};
+		alignas(T) unsigned char	m_storage[sizeof(T)];
+
+		T* data() { return std::launder(reinterpret_cast<T*>(m_storage)); }
+
+		template <typename... Args>
+		void construct(Args&&... args) { new (m_storage) T(std::forward<Args>(args)...); }
+		void construct_default() { new (m_storage) T; }
+		void destroy() { data()->~T(); }
+	};
+
+	// Only sizes the inline ring of a capacity<N> queue, never constructed
+	struct inline_layout
+	{
+		shm_header	m_header;
+		queue		m_queue;
+		Cell_t		m_cells[Capacity ? Capacity : 1];
+	};
+
+	struct alignas(inline_layout) inline_ring
+	{
+		unsigned char m_bytes[sizeof(inline_layout)];
+		unsigned char* data() { return m_bytes; }
+		const unsigned char* data() const { return m_bytes; }
+	};
+
+	struct no_inline_ring
+	{
+		unsigned char* data() { return nullptr; }
+		const unsigned char* data() const { return nullptr; }
 	};
 
 	const uint64_t		m_q_pos_mask_;
 	Cell_t*				m_q_mem;
 	queue*				m_q{nullptr};
+	void*				m_map{nullptr}; // owned mapping, null for shared buffers
+	uint64_t			m_map_size{0};
+
+	// positions cached by a single producer/consumer, each on its own line
+	alignas(64) uint64_t	m_enq_local{0};
+	alignas(64) uint64_t	m_deq_local{0};
+
+	std::conditional_t<Capacity != 0, inline_ring, no_inline_ring>	m_inline;
+
+	// takes no room with no_stats
+	[[no_unique_address]] typename stats_policy::counters	m_stats;
 
 	mpmc_queue(const mpmc_queue&) = delete;
 	void operator = (const mpmc_queue&) = delete;
 }; 
+
+template <typename T>
+using spsc_queue = mpmc_queue<T, single_producer, single_consumer>;
+
+template <typename T>
+using mpsc_queue = mpmc_queue<T, multi_producer, single_consumer>;
+
+template <typename T>
+using spmc_queue = mpmc_queue<T, single_producer, multi_consumer>;
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "mpmc_wait.h"
+
+// One epoll set over several queues built with eventfd_wait and any other
+// fds the thread serves, such as its sockets. A queue's eventfd is only
+// written on an empty to non-empty transition, so a thread that drains a
+// queue in one go costs its producers one write per burst.
+//
+// A queue returned by select() must be drained and then passed to done(),
+// which re-arms its notifier and checks the queue once more. done() on an
+// id from add_fd() does nothing and returns true.
+//
+//     for (uint32_t id : ready)
+//         do { while (q[id].pop(v)) handle(v); } while (!sel.done(id));
+//
+// Only one thread should drain a given queue this way.
+class mpmc_selector
+{
+	struct entry
+	{
+		eventfd_wait::channel*	m_chan{nullptr};	// null for a plain fd
+		void*					m_queue{nullptr};
+		bool					(*m_empty)(void*){nullptr};
+	};
+
+public:
+	enum Limits : uint32_t { MaxEvents = 64 };
+
+	mpmc_selector()
+		: m_epoll(::epoll_create1(EPOLL_CLOEXEC))
+	{
+		if (m_epoll < 0)
+			throw std::system_error(errno, std::generic_category(), "mpmc_selector: epoll_create1");
+	}
+
+	~mpmc_selector()
+	{
+		::close(m_epoll);
+	}
+
+	// Adds q, which must use eventfd_wait, and returns its id. A queue that
+	// already holds elements is reported by the next select().
+	template <typename Q>
+	uint32_t add(Q& q)
+	{
+		static_assert(std::is_same<std::decay_t<decltype(q.not_empty_channel())>, eventfd_wait::channel>::value,
+					  "mpmc_selector needs queues built with eventfd_wait");
+
+		eventfd_wait::channel& c = q.not_empty_channel();
+		uint32_t id = add_entry(c.fd(), EPOLLIN, entry{&c, &q, [] (void* p) { return static_cast<Q*>(p)->empty(); }});
+
+		c.arm();
+		if (!q.empty())
+			eventfd_wait::notify(c);
+
+		return id;
+	}
+
+	// Adds a plain fd, e.g. a socket, polled for events
+	uint32_t add_fd(int fd, uint32_t events = EPOLLIN)
+	{
+		return add_entry(fd, events, entry{});
+	}
+
+	// Waits up to timeout_ms (-1 for ever) and replaces the contents of
+	// ready with the ids that are ready. Returns their number, 0 on timeout
+	// or when interrupted by a signal.
+	uint32_t select(std::vector<uint32_t>& ready, int timeout_ms = -1)
+	{
+		epoll_event events[MaxEvents];
+
+		ready.clear();
+
+		int n = ::epoll_wait(m_epoll, events, MaxEvents, timeout_ms);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				return 0;
+
+			throw std::system_error(errno, std::generic_category(), "mpmc_selector: epoll_wait");
+		}
+
+		for (int i = 0; i < n; ++i)
+		{
+			uint32_t id = events[i].data.u32;
+
+			if (m_entries[id].m_chan)
+				m_entries[id].m_chan->clear();
+
+			ready.push_back(id);
+		}
+
+		return n;
+	}
+
+	// Call once queue id has been drained. Re-arms its notifier, then
+	// returns false when elements arrived since the drain, in which case
+	// drain it again and call done() again. Always true for a plain fd.
+	bool done(uint32_t id)
+	{
+		entry& e = m_entries[id];
+
+		if (!e.m_chan)
+			return true;
+
+		e.m_chan->arm();
+
+		return e.m_empty(e.m_queue);
+	}
+
+private:
+	uint32_t add_entry(int fd, uint32_t events, const entry& e)
+	{
+		uint32_t id = m_entries.size();
+
+		epoll_event ev{};
+		ev.events = events;
+		ev.data.u32 = id;
+
+		if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+			throw std::system_error(errno, std::generic_category(), "mpmc_selector: epoll_ctl");
+
+		m_entries.push_back(e);
+		return id;
+	}
+
+	int					m_epoll{-1};
+	std::vector<entry>	m_entries;
+
+	mpmc_selector(const mpmc_selector&) = delete;
+	void operator = (const mpmc_selector&) = delete;
+};
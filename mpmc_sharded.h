@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "mpmc_q.h"
+#include "mpmc_thread.h"
+
+// Front end over several mpmc_queue shards so producers and consumers stop
+// sharing one m_enq_pos/m_deq_pos. Producers get home shards round robin
+// on their first push, so the first min(producers, shards) shards are the
+// ones written to, and consumers get homes round robin among those on
+// every pop. Producers push to their home shard and only spill to the
+// others when it is full. Consumers drain their home shard and, when it
+// runs dry, steal up to StealBatch elements from another shard with one
+// pop_bulk, keeping the surplus in a per-thread stash that is served
+// before the shards on the next pop.
+//
+// Ordering is FIFO per shard only. Stolen elements are not visible to the
+// other consumers: a consumer thread takes what is left in its stash with
+// pop_stashed() before it exits.
+template<typename T, typename Shard = mpmc_queue<T>>
+class mpmc_sharded_queue
+{
+public:
+	enum Size : uint32_t { StealBatch = 16 };
+
+	// shards == 0 uses one shard per hardware thread
+	mpmc_sharded_queue(uint64_t shard_elements, uint32_t shards = 0)
+		: m_count(shards ? shards : std::max(1u, std::thread::hardware_concurrency()))
+	{
+		m_shards.reserve(m_count);
+		for (uint32_t i = 0; i != m_count; ++i)
+			m_shards.push_back(std::make_unique<Shard>(shard_elements));
+	}
+
+	bool push(const T& data)
+	{
+		stash& st = m_stash[mpmc_detail::thread_index()];
+
+		if (st.m_push_home == NoHome)
+			st.m_push_home = m_producers.fetch_add(1, std::memory_order_relaxed) % m_count;
+
+		uint32_t home = st.m_push_home;
+
+		for (uint32_t i = 0; i != m_count; ++i)
+		{
+			if (m_shards[(home + i) % m_count]->push(data))
+				return true;
+		}
+
+		return false;
+	}
+
+	bool pop(T& data)
+	{
+		stash& st = m_stash[mpmc_detail::thread_index()];
+
+		if (pop_stashed(data))
+			return true;
+
+		if (st.m_pop_ticket == NoHome)
+			st.m_pop_ticket = m_consumers.fetch_add(1, std::memory_order_relaxed);
+
+		// the shards producers write to, re-read as producers register
+		uint32_t written = std::clamp<uint32_t>(m_producers.load(std::memory_order_relaxed), 1, m_count);
+		uint32_t home = st.m_pop_ticket % written;
+
+		if (m_shards[home]->pop(data))
+			return true;
+
+		// home shard is dry, steal a batch from the next non-empty one
+		for (uint32_t i = 1; i < m_count; ++i)
+		{
+			Shard& victim = *m_shards[(home + i) % m_count];
+
+			if (!st.m_items)
+				st.m_items = std::make_unique<T[]>(StealBatch);
+
+			uint64_t n = victim.pop_bulk(st.m_items.get(), StealBatch);
+
+			if (n)
+			{
+				data = std::move(st.m_items[0]);
+				st.m_head = 1;
+				st.m_count = n;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Takes the next element the calling thread stole and has not returned
+	// yet, false once its stash is empty. A consumer calls it until it
+	// fails before exiting, the elements are lost otherwise.
+	bool pop_stashed(T& data)
+	{
+		stash& st = m_stash[mpmc_detail::thread_index()];
+
+		if (st.m_head == st.m_count)
+			return false;
+
+		data = std::move(st.m_items[st.m_head++]);
+		return true;
+	}
+
+	uint32_t shards() const { return m_count; }
+	Shard& shard(uint32_t i) { return *m_shards[i]; }
+
+private:
+	static constexpr uint32_t NoHome = ~0u;
+
+	// Per-thread state: the homes handed out on the thread's first push
+	// and pop, and the elements it stole but has not returned yet. Only
+	// touched by the owning thread, the items array is allocated on its
+	// first steal. A slot reused by a later thread keeps its homes.
+	struct alignas(64) stash
+	{
+		std::unique_ptr<T[]>	m_items;
+		uint64_t				m_head{0};
+		uint64_t				m_count{0};
+		uint32_t				m_push_home{NoHome};
+		uint32_t				m_pop_ticket{NoHome};
+	};
+
+	const uint32_t						m_count;
+	std::vector<std::unique_ptr<Shard>>	m_shards;
+	stash								m_stash[mpmc_detail::MaxThreads];
+
+	alignas(64) std::atomic<uint32_t>	m_producers{0};	// producer homes handed out
+	std::atomic<uint32_t>				m_consumers{0};	// consumer tickets handed out
+
+	mpmc_sharded_queue(const mpmc_sharded_queue&) = delete;
+	void operator = (const mpmc_sharded_queue&) = delete;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "mpmc_thread.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Instrumentation policies for mpmc_queue, selected with the queue's
+// options, e.g. mpmc_queue<T, contention_stats>.
+//
+// A policy provides the counters, which live in the queue object (per
+// process, thread indices are not shared), and count() which the queue
+// calls on every contention event. no_stats, the default, compiles away.
+///////////////////////////////////////////////////////////////////////////////
+namespace mpmc_opt
+{
+struct stats_tag {};
+}
+
+enum class mpmc_event : uint32_t
+{
+	  CasFailure	// lost a compare_exchange on a shared position
+	, Full			// push found the next cell not yet released
+	, Empty			// pop found nothing claimed past its position
+	, Unpublished	// pop found a claimed cell its producer has not published
+	, Count
+};
+
+// Totals over all threads, see mpmc_queue::stats()
+struct mpmc_stats
+{
+	uint64_t cas_failures{0};
+	uint64_t full{0};
+	uint64_t empty{0};
+	uint64_t unpublished{0};
+};
+
+struct no_stats
+{
+	using option_tag = mpmc_opt::stats_tag;
+
+	static constexpr bool enabled = false;
+
+	struct counters {};
+
+	static void count(counters&, mpmc_event) {}
+	static mpmc_stats collect(const counters&) { return mpmc_stats(); }
+};
+
+// One cache line of counters per thread. Only the owning thread writes its
+// line, with a plain load and store rather than a locked add, so counting
+// costs no more than the event itself. collect() may run concurrently and
+// sees slightly stale totals. The lines are embedded in the queue object:
+// MaxThreads (256) x 64 bytes, 16 KB in every queue built with the option.
+struct contention_stats
+{
+	using option_tag = mpmc_opt::stats_tag;
+
+	static constexpr bool enabled = true;
+
+	struct alignas(64) line
+	{
+		std::atomic<uint64_t> m_events[static_cast<uint32_t>(mpmc_event::Count)];
+	};
+
+	struct counters
+	{
+		line m_threads[mpmc_detail::MaxThreads] = {};
+	};
+
+	static void count(counters& c, mpmc_event e)
+	{
+		std::atomic<uint64_t>& v = c.m_threads[mpmc_detail::thread_index()].m_events[static_cast<uint32_t>(e)];
+		v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	static mpmc_stats collect(const counters& c)
+	{
+		mpmc_stats s;
+
+		for (const line& l : c.m_threads)
+		{
+			s.cas_failures += l.m_events[static_cast<uint32_t>(mpmc_event::CasFailure)].load(std::memory_order_relaxed);
+			s.full += l.m_events[static_cast<uint32_t>(mpmc_event::Full)].load(std::memory_order_relaxed);
+			s.empty += l.m_events[static_cast<uint32_t>(mpmc_event::Empty)].load(std::memory_order_relaxed);
+			s.unpublished += l.m_events[static_cast<uint32_t>(mpmc_event::Unpublished)].load(std::memory_order_relaxed);
+		}
+
+		return s;
+	}
+};
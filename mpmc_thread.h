@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+
+namespace mpmc_detail
+{
+
+// Upper bound on threads using a queue at once, sizes per-thread arrays
+constexpr uint32_t MaxThreads = 256;
+
+// A small dense index for the calling thread in [0, MaxThreads), handed
+// back when the thread exits so per-thread arrays can be reused by the
+// threads that come after it.
+inline uint32_t thread_index()
+{
+	static std::atomic<bool> used[MaxThreads];
+
+	struct registration
+	{
+		uint32_t m_idx{MaxThreads};
+
+		registration()
+		{
+			for (uint32_t i = 0; i != MaxThreads; ++i)
+			{
+				bool expected = false;
+				if (!used[i].load(std::memory_order_relaxed)
+					&& used[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+				{
+					m_idx = i;
+					return;
+				}
+			}
+
+			std::cerr << "mpmc: more than " << MaxThreads << " threads" << std::endl;
+			std::terminate();
+		}
+
+		~registration()
+		{
+			used[m_idx].store(false, std::memory_order_release);
+		}
+	};
+
+	thread_local registration r;
+	return r.m_idx;
+}
+
+} // mpmc_detail
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "mpmc_thread.h"
+
+// Unbounded MPMC queue built from a linked list of fixed size segments.
+// Within a segment producers and consumers claim cells with a fetch_add on
+// the segment's index (FAA array queue / LCRQ style), so the hot path has
+// no CAS retry loop on a shared position. A producer that runs off the end
+// of the tail segment links a new one. Segments drained by the consumers
+// go to a recycling pool once no hazard pointer refers to them, so in
+// steady state the queue allocates nothing.
+//
+// Cells are used once per trip of a segment through the list rather than
+// wrapping like mpmc_queue's ring; recycling the whole segment plays the
+// part of the wrap.
+template<typename T>
+class mpmc_unbounded_queue
+{
+public:
+
+mpmc_unbounded_queue(uint64_t segment_cells = 1024)
+	: m_segment_cells(segment_cells)
+{
+	assert(segment_cells >= 2);
+
+	segment* s = new segment(m_segment_cells);
+	m_head.store(s, std::memory_order_relaxed);
+	m_tail.store(s, std::memory_order_relaxed);
+}
+
+~mpmc_unbounded_queue()
+{
+	segment* s = m_head.load(std::memory_order_relaxed);
+
+	while (s)
+	{
+		segment* next = s->m_next.load(std::memory_order_relaxed);
+		s->destroy_live(m_segment_cells);
+		delete s;
+		s = next;
+	}
+
+	for (segment* r : m_retired)
+		delete r;
+
+	for (segment* r : m_pool)
+		delete r;
+}
+
+// Never fails, returns bool to share push()'s signature with mpmc_queue.
+template <typename... Args>
+bool emplace(Args&&... args)
+{
+	auto& hazard = m_hazards[mpmc_detail::thread_index()].m_ptr;
+
+	for(;;)
+	{
+		segment* tail = protect(m_tail, hazard);
+		uint64_t idx = tail->m_enq_idx.fetch_add(1, std::memory_order_relaxed);
+
+		if (idx < m_segment_cells)
+		{
+			Cell_t& cell = tail->m_cells[idx];
+			uint32_t expected = Cell_t::Empty;
+
+			// a consumer that found the cell empty may have given up on it
+			if (!cell.m_state.compare_exchange_strong(expected, Cell_t::Busy, std::memory_order_acquire))
+				continue;
+
+			cell.construct(std::forward<Args>(args)...);
+			cell.m_state.store(Cell_t::Full, std::memory_order_release);
+			hazard.store(nullptr, std::memory_order_release);
+			return true;
+		}
+
+		// tail segment exhausted, link (or help link) the next one
+		if (tail != m_tail.load(std::memory_order_acquire))
+			continue;
+
+		segment* next = tail->m_next.load(std::memory_order_acquire);
+
+		if (next == nullptr)
+		{
+			segment* fresh = acquire_segment();
+			if (tail->m_next.compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+				m_tail.compare_exchange_strong(tail, fresh, std::memory_order_acq_rel);
+			else
+				recycle(fresh); // never visible to other threads
+		}
+		else
+			m_tail.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+	}
+}
+
+bool push(const T& data)
+{
+	return emplace(data);
+}
+
+bool push(T&& data)
+{
+	return emplace(std::move(data));
+}
+
+bool pop(T& data)
+{
+	auto& hazard = m_hazards[mpmc_detail::thread_index()].m_ptr;
+
+	for(;;)
+	{
+		segment* head = protect(m_head, hazard);
+
+		if (head->m_deq_idx.load(std::memory_order_relaxed) >= head->m_enq_idx.load(std::memory_order_relaxed)
+			&& head->m_next.load(std::memory_order_acquire) == nullptr)
+			break; // empty
+
+		uint64_t idx = head->m_deq_idx.fetch_add(1, std::memory_order_relaxed);
+
+		if (idx < m_segment_cells)
+		{
+			Cell_t& cell = head->m_cells[idx];
+
+			if (!wait_full(head, cell, idx))
+				continue; // no producer for this cell yet, it is given up
+
+			data = std::move(*cell.data());
+			cell.destroy();
+			cell.m_state.store(Cell_t::Taken, std::memory_order_relaxed);
+			hazard.store(nullptr, std::memory_order_release);
+			return true;
+		}
+
+		// head segment drained, move on to the next one
+		segment* next = head->m_next.load(std::memory_order_acquire);
+
+		if (next == nullptr)
+			break;
+
+		// the tail must not be left on a segment about to be recycled
+		segment* tail = head;
+		m_tail.compare_exchange_strong(tail, next, std::memory_order_acq_rel);
+
+		if (m_head.compare_exchange_strong(head, next, std::memory_order_acq_rel))
+			retire(head);
+	}
+
+	hazard.store(nullptr, std::memory_order_release);
+	return false;
+}
+
+private:
+	struct Cell_t
+	{
+		enum State : uint32_t { Empty, Busy, Full, Taken };
+
+		std::atomic<uint32_t>		m_state{Empty};
+		alignas(T) unsigned char	m_storage[sizeof(T)];
+
+		T* data() { return std::launder(reinterpret_cast<T*>(m_storage)); }
+
+		template <typename... Args>
+		void construct(Args&&... args) { new (m_storage) T(std::forward<Args>(args)...); }
+		void destroy() { data()->~T(); }
+	};
+
+	struct segment
+	{
+		explicit segment(uint64_t cells)
+			: m_cells(new Cell_t[cells])
+		{}
+
+		~segment() { delete [] m_cells; }
+
+		void reset(uint64_t cells)
+		{
+			m_enq_idx.store(0, std::memory_order_relaxed);
+			m_deq_idx.store(0, std::memory_order_relaxed);
+			m_next.store(nullptr, std::memory_order_relaxed);
+
+			for (uint64_t i = 0; i != cells; ++i)
+				m_cells[i].m_state.store(Cell_t::Empty, std::memory_order_relaxed);
+		}
+
+		void destroy_live(uint64_t cells)
+		{
+			for (uint64_t i = 0; i != cells; ++i)
+				if (m_cells[i].m_state.load(std::memory_order_relaxed) == Cell_t::Full)
+					m_cells[i].destroy();
+		}
+
+		alignas(64) std::atomic<uint64_t>	m_enq_idx{0};
+		alignas(64) std::atomic<uint64_t>	m_deq_idx{0};
+		alignas(64) std::atomic<segment*>	m_next{nullptr};
+		Cell_t*								m_cells;
+	};
+
+	struct alignas(64) hazard_t
+	{
+		std::atomic<segment*> m_ptr{nullptr};
+	};
+
+	// Publishes the segment src points to in the caller's hazard slot and
+	// re-reads src, so a segment returned here is not recycled until the
+	// slot is cleared.
+	static segment* protect(std::atomic<segment*>& src, std::atomic<segment*>& hazard)
+	{
+		segment* s = src.load(std::memory_order_acquire);
+
+		for(;;)
+		{
+			hazard.store(s, std::memory_order_seq_cst);
+			segment* again = src.load(std::memory_order_seq_cst);
+
+			if (again == s)
+				return s;
+
+			s = again;
+		}
+	}
+
+	// Returns true once cell idx holds a payload, false when the consumer
+	// gave the cell up (marked Taken) because no producer had claimed it.
+	bool wait_full(segment* s, Cell_t& cell, uint64_t idx)
+	{
+		for(;;)
+		{
+			uint32_t state = cell.m_state.load(std::memory_order_acquire);
+
+			if (state == Cell_t::Full)
+				return true;
+
+			if (state == Cell_t::Empty && idx >= s->m_enq_idx.load(std::memory_order_relaxed))
+			{
+				// no producer has this index, make whoever gets it retry
+				if (cell.m_state.compare_exchange_strong(state, Cell_t::Taken, std::memory_order_acquire))
+					return false;
+				continue;
+			}
+
+			// a producer owns the cell and is writing it
+			__builtin_ia32_pause();
+		}
+	}
+
+	// Called by the consumer that unlinked s from the head
+	void retire(segment* s)
+	{
+		std::lock_guard<std::mutex> lock(m_pool_lock);
+		m_retired.push_back(s);
+	}
+
+	void recycle(segment* s)
+	{
+		s->reset(m_segment_cells);
+
+		std::lock_guard<std::mutex> lock(m_pool_lock);
+		m_pool.push_back(s);
+	}
+
+	bool hazardous(segment* s) const
+	{
+		for (const auto& h : m_hazards)
+			if (h.m_ptr.load(std::memory_order_seq_cst) == s)
+				return true;
+
+		return false;
+	}
+
+	// Only taken once per segment's worth of messages, so the lock is off
+	// the hot path.
+	segment* acquire_segment()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_pool_lock);
+
+			for (uint64_t i = 0; i != m_retired.size();)
+			{
+				segment* s = m_retired[i];
+				if (hazardous(s))
+				{
+					++i;
+					continue;
+				}
+
+				m_retired[i] = m_retired.back();
+				m_retired.pop_back();
+				s->reset(m_segment_cells);
+				m_pool.push_back(s);
+			}
+
+			if (!m_pool.empty())
+			{
+				segment* s = m_pool.back();
+				m_pool.pop_back();
+				return s;
+			}
+		}
+
+		return new segment(m_segment_cells);
+	}
+
+	const uint64_t			m_segment_cells;
+
+	alignas(64) std::atomic<segment*>	m_head{nullptr};
+	alignas(64) std::atomic<segment*>	m_tail{nullptr};
+
+	hazard_t				m_hazards[mpmc_detail::MaxThreads];
+
+	std::mutex				m_pool_lock;
+	std::vector<segment*>	m_retired;	// unlinked, may still be referenced
+	std::vector<segment*>	m_pool;		// reset and ready for reuse
+
+	mpmc_unbounded_queue(const mpmc_unbounded_queue&) = delete;
+	void operator = (const mpmc_unbounded_queue&) = delete;
+};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <system_error>
+#include <thread>
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "getcc.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait strategies for mpmc_queue::push_wait/pop_wait, selected with the
+// queue's options, e.g. mpmc_queue<T, futex_wait>.
+//
+// A strategy provides a channel, which lives in the queue's control block,
+// wait() to block until an operation succeeds and notify() which the
+// opposite side calls after every successful operation. notify() must stay
+// free of syscalls unless a waiter is actually parked. shareable says
+// whether the channel works across processes, i.e. the queue may be built
+// in a shared buffer, and id tags the strategy in that buffer's header so
+// processes built with different strategies cannot attach to each other.
+///////////////////////////////////////////////////////////////////////////////
+namespace mpmc_opt
+{
+struct wait_tag {};
+}
+
+namespace mpmc_detail
+{
+
+// Retries op until it succeeds or the TSC passes deadline, for the timed
+// try_push/try_pop calls. The first SpinLimit retries are back to back
+// (with one pause), then the gap between retries doubles up to
+// MaxBackoffCycles. Backing off re-reads the TSC after every pause and
+// stops at the deadline, so the call returns within a pause of it
+// however far the backoff has grown. No syscall reads the clock.
+template <typename Op>
+bool retry_until(uint64_t deadline, Op&& op)
+{
+	constexpr uint32_t SpinLimit = 16;
+	constexpr uint64_t MaxBackoffCycles = 4096;
+
+	uint64_t backoff = 64;
+
+	for (uint32_t i = 0;; ++i)
+	{
+		if (op())
+			return true;
+
+		uint64_t now = getcc_ns();
+
+		if (now >= deadline)
+			return false;
+
+		if (i < SpinLimit)
+		{
+			__builtin_ia32_pause();
+			continue;
+		}
+
+		uint64_t until = std::min(now + backoff, deadline);
+
+		while (getcc_ns() < until)
+			__builtin_ia32_pause();
+
+		backoff = std::min(backoff * 2, MaxBackoffCycles);
+	}
+}
+
+} // mpmc_detail
+
+// Filled in by the blocking calls when a caller was parked.
+struct wait_stats
+{
+	uint32_t wakeups{0};		// times the caller was parked and woken
+	uint64_t wake_cycles{0};	// TSC cycles from the waker's notify to the caller running
+};
+
+// Retries the operation back to back, the default.
+struct busy_spin_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = true;
+	static constexpr uint32_t id = 1;
+
+	struct channel {};
+
+	static void notify(channel&, uint64_t = 1) {}
+
+	template <typename Op>
+	static void wait(channel&, Op&& op, wait_stats*)
+	{
+		while (!op())
+			__builtin_ia32_pause();
+	}
+};
+
+// Spins for a while, then gives the core away between retries.
+struct spin_yield_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = true;
+	static constexpr uint32_t id = 2;
+
+	enum Limits : uint32_t { SpinLimit = 256 };
+
+	struct channel {};
+
+	static void notify(channel&, uint64_t = 1) {}
+
+	template <typename Op>
+	static void wait(channel&, Op&& op, wait_stats*)
+	{
+		for (uint32_t i = 0; !op(); ++i)
+		{
+			if (i < SpinLimit)
+				__builtin_ia32_pause();
+			else
+				std::this_thread::yield();
+		}
+	}
+};
+
+// Doubles the number of pauses between retries up to MaxPauses, backing
+// off the shared lines when the other side is slow.
+struct backoff_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = true;
+	static constexpr uint32_t id = 3;
+
+	enum Limits : uint32_t { MaxPauses = 1024 };
+
+	struct channel {};
+
+	static void notify(channel&, uint64_t = 1) {}
+
+	template <typename Op>
+	static void wait(channel&, Op&& op, wait_stats*)
+	{
+		for (uint32_t pauses = 1; !op(); pauses = (pauses < MaxPauses) ? pauses * 2 : pauses)
+		{
+			for (uint32_t i = 0; i < pauses; ++i)
+				__builtin_ia32_pause();
+		}
+	}
+};
+
+// Spins briefly, then parks on a futex. Waiters register in m_waiters so
+// notify() costs a fence and a load while nobody is parked, and only then
+// bumps the epoch and issues FUTEX_WAKE. Shared (not PRIVATE) futex ops
+// so queues in shared memory can park across processes.
+struct futex_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = true;
+	static constexpr uint32_t id = 4;
+
+	enum Limits : uint32_t { SpinLimit = 256 };
+
+	struct alignas(64) channel
+	{
+		std::atomic<uint32_t>	m_epoch{0};
+		std::atomic<uint32_t>	m_waiters{0};
+		std::atomic<uint64_t>	m_wake_tsc{0};
+	};
+
+	// count is how many elements/cells the caller made available
+	static void notify(channel& c, uint64_t count = 1)
+	{
+		// pairs with the fence in wait(): either we see the waiter or it
+		// sees what we just published
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (c.m_waiters.load(std::memory_order_relaxed) == 0)
+			return;
+
+		c.m_wake_tsc.store(getcc_ns(), std::memory_order_relaxed);
+		c.m_epoch.fetch_add(1, std::memory_order_release);
+
+		int wake = (count < INT_MAX) ? static_cast<int>(count) : INT_MAX;
+		::syscall(SYS_futex, &c.m_epoch, FUTEX_WAKE, wake, nullptr, nullptr, 0);
+	}
+
+	template <typename Op>
+	static void wait(channel& c, Op&& op, wait_stats* stats)
+	{
+		for (uint32_t i = 0; i < SpinLimit; ++i)
+		{
+			if (op())
+				return;
+			__builtin_ia32_pause();
+		}
+
+		c.m_waiters.fetch_add(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		for(;;)
+		{
+			// read before retrying so a notify in between changes it and
+			// FUTEX_WAIT returns straight away
+			uint32_t epoch = c.m_epoch.load(std::memory_order_acquire);
+
+			if (op())
+				break;
+
+			if (::syscall(SYS_futex, &c.m_epoch, FUTEX_WAIT, epoch, nullptr, nullptr, 0) == 0 && stats)
+			{
+				++stats->wakeups;
+				stats->wake_cycles += getcc_ns() - c.m_wake_tsc.load(std::memory_order_relaxed);
+			}
+		}
+
+		c.m_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+};
+
+// Raises an eventfd, so a consumer can wait on the queue from epoll next to
+// its sockets (see mpmc_selector in mpmc_select.h). The fd is only written
+// when a waiter armed the channel: a waiter sets m_armed before its last
+// re-check of the queue and the first notify() to find it set clears it
+// and writes, so producers pay one write per empty to non-empty transition
+// and a fence and a load otherwise. The fd belongs to the process that
+// built the queue, so queues using it are in process only.
+struct eventfd_wait
+{
+	using option_tag = mpmc_opt::wait_tag;
+	static constexpr bool shareable = false;
+	static constexpr uint32_t id = 5;
+
+	enum Limits : uint32_t { SpinLimit = 256 };
+
+	struct alignas(64) channel
+	{
+		std::atomic<uint32_t>	m_armed{0};
+		std::atomic<uint32_t>	m_waiters{0};	// parked in wait()
+		int						m_fd{-1};
+		std::atomic<uint64_t>	m_signals{0};	// writes to m_fd so far
+		std::atomic<uint64_t>	m_wake_tsc{0};
+
+		channel()
+			: m_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+		{
+			if (m_fd < 0)
+				throw std::system_error(errno, std::generic_category(), "eventfd_wait: eventfd");
+		}
+
+		~channel()
+		{
+			::close(m_fd);
+		}
+
+		channel(const channel&) = delete;
+		void operator = (const channel&) = delete;
+
+		int fd() const { return m_fd; }
+
+		uint64_t signals() const { return m_signals.load(std::memory_order_relaxed); }
+
+		// Resets the fd once it polled readable
+		void clear()
+		{
+			uint64_t v;
+			ssize_t r = ::read(m_fd, &v, sizeof(v));
+			(void)r;
+		}
+
+		// Call when the queue was found empty, then check it once more
+		// before blocking on the fd: either that check sees what a producer
+		// published or the producer's notify() sees the flag.
+		void arm()
+		{
+			m_armed.store(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+
+		void signal()
+		{
+			m_wake_tsc.store(getcc_ns(), std::memory_order_relaxed);
+			m_signals.fetch_add(1, std::memory_order_relaxed);
+
+			uint64_t one = 1;
+			ssize_t r = ::write(m_fd, &one, sizeof(one));
+			(void)r;
+		}
+	};
+
+	static void notify(channel& c, uint64_t = 1)
+	{
+		// pairs with the fence in arm()
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		if (c.m_armed.load(std::memory_order_relaxed) == 0
+			|| c.m_armed.exchange(0, std::memory_order_relaxed) == 0)
+			return;
+
+		c.signal();
+	}
+
+	// One write wakes every waiter polling the fd, but whoever clears it
+	// first may leave others to sleep through elements published after the
+	// flag was taken. A waiter that got its element while others are still
+	// parked hands the wakeup on, so each of them re-checks once.
+	template <typename Op>
+	static void wait(channel& c, Op&& op, wait_stats* stats)
+	{
+		for (uint32_t i = 0; i < SpinLimit; ++i)
+		{
+			if (op())
+				return;
+			__builtin_ia32_pause();
+		}
+
+		c.m_waiters.fetch_add(1, std::memory_order_relaxed);
+
+		for(;;)
+		{
+			c.arm();
+
+			if (op())
+				break;
+
+			pollfd p{c.m_fd, POLLIN, 0};
+
+			if (::poll(&p, 1, -1) == 1)
+			{
+				c.clear();
+
+				if (stats)
+				{
+					++stats->wakeups;
+					stats->wake_cycles += getcc_ns() - c.m_wake_tsc.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		if (c.m_waiters.fetch_sub(1, std::memory_order_relaxed) > 1)
+			c.signal();
+	}
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// An mmap'd region that can be shared between processes, backed by a
+// named POSIX shm object, an anonymous memfd or a regular file.
+// mpmc_queue builds itself inside one with mpmc_queue(q_elements, addr())
+// and other processes attach with mpmc_queue(addr()).
+class shm_region
+{
+public:
+	enum class Backing
+	{
+		  PosixShm  // name is a shm_open name, e.g. "/feed_q"
+		, MemFd     // name is only a debug label, share the fd by fork/SCM_RIGHTS
+		, File      // name is a path
+	};
+
+	// Creates (or truncates) a region of size bytes.
+	static shm_region create(Backing backing, const std::string& name, uint64_t size)
+	{
+		int fd = -1;
+
+		switch (backing)
+		{
+		case Backing::PosixShm:
+			fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+			break;
+		case Backing::MemFd:
+			fd = ::memfd_create(name.c_str(), 0);
+			break;
+		case Backing::File:
+			fd = ::open(name.c_str(), O_CREAT | O_RDWR, 0600);
+			break;
+		}
+
+		if (fd == -1)
+			throw std::system_error(errno, std::system_category(), "shm_region: create " + name);
+
+		if (::ftruncate(fd, size) == -1)
+		{
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::system_category(), "shm_region: ftruncate " + name);
+		}
+
+		shm_region r(fd, size);
+		if (backing == Backing::PosixShm)
+			r.m_unlink = name;
+		return r;
+	}
+
+	// Attaches to an existing named region, the size is taken from the object.
+	static shm_region open(Backing backing, const std::string& name)
+	{
+		int fd = -1;
+
+		if (backing == Backing::PosixShm)
+			fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+		else if (backing == Backing::File)
+			fd = ::open(name.c_str(), O_RDWR);
+		else
+			throw std::system_error(EINVAL, std::system_category(), "shm_region: memfd has no name to open, use from_fd");
+
+		if (fd == -1)
+			throw std::system_error(errno, std::system_category(), "shm_region: open " + name);
+
+		return from_fd(fd);
+	}
+
+	// Takes ownership of fd (e.g. an inherited memfd) and maps all of it.
+	static shm_region from_fd(int fd)
+	{
+		struct stat st;
+
+		if (::fstat(fd, &st) == -1)
+		{
+			int err = errno;
+			::close(fd);
+			throw std::system_error(err, std::system_category(), "shm_region: fstat");
+		}
+
+		return shm_region(fd, st.st_size);
+	}
+
+	shm_region(shm_region&& r)
+		: m_fd(std::exchange(r.m_fd, -1))
+		, m_size(std::exchange(r.m_size, 0))
+		, m_addr(std::exchange(r.m_addr, nullptr))
+		, m_unlink(std::move(r.m_unlink))
+	{
+		r.m_unlink.clear();
+	}
+
+	~shm_region()
+	{
+		if (m_addr)
+			::munmap(m_addr, m_size);
+		if (m_fd != -1)
+			::close(m_fd);
+	}
+
+	// Removes the name of a PosixShm region created here, existing
+	// mappings stay valid. Not done by the destructor so a creator can
+	// hand the ring over and exit.
+	void unlink()
+	{
+		if (!m_unlink.empty())
+			::shm_unlink(m_unlink.c_str());
+		m_unlink.clear();
+	}
+
+	void* addr() const { return m_addr; }
+	uint64_t size() const { return m_size; }
+	int fd() const { return m_fd; }
+
+private:
+	shm_region(int fd, uint64_t size)
+		: m_fd(fd)
+		, m_size(size)
+	{
+		m_addr = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+		if (m_addr == MAP_FAILED)
+		{
+			int err = errno;
+			m_addr = nullptr;
+			::close(m_fd);
+			m_fd = -1;
+			throw std::system_error(err, std::system_category(), "shm_region: mmap");
+		}
+	}
+
+	int			m_fd{-1};
+	uint64_t	m_size{0};
+	void*		m_addr{nullptr};
+	std::string	m_unlink;
+
+	shm_region(const shm_region&) = delete;
+	void operator = (const shm_region&) = delete;
+};